@@ -18,6 +18,8 @@
 
 #include "logic/InstanceLauncher.h"
 #include "logic/net/HttpMetaCache.h"
+#include "logic/net/ForgeMirrorStats.h"
+#include "logic/net/UrlResolver.h"
 
 #include "logic/JavaUtils.h"
 
@@ -156,6 +158,9 @@ MultiMC::MultiMC(int &argc, char **argv) : QApplication(argc, argv)
 	// init the http meta cache
 	initHttpMetaCache();
 
+	// the last known Minecraft versions, until the list is refreshed
+	minecraftlist()->loadCachedList();
+
 	// set up a basic autodetected proxy (system default)
 	QNetworkProxyFactory::setUseSystemConfiguration(true);
 
@@ -199,8 +204,10 @@ MultiMC::MultiMC(int &argc, char **argv) : QApplication(argc, argv)
 		QLOG_INFO() << proxyDesc;
 	}
 
-	// create the global network manager
-	m_qnam.reset(new QNetworkAccessManager(this));
+	// create the global network manager. everything it fetches can be redirected, see UrlResolver
+	m_url_resolver = std::make_shared<UrlResolver>();
+	m_url_resolver->load("url_rewrite.list");
+	m_qnam.reset(new ResolvingNetworkAccessManager(m_url_resolver, this));
 
 	// launch instance, if that's what should be done
 	if (!args["launch"].isNull())
@@ -322,6 +329,19 @@ void MultiMC::initGlobalSettings()
 	m_settings->registerSetting(new Setting("PreLaunchCommand", ""));
 	m_settings->registerSetting(new Setting("PostExitCommand", ""));
 
+	// Network
+	m_settings->registerSetting(new Setting("NetMaxInFlight", 16));
+	m_settings->registerSetting(new Setting("NetMaxInFlightPerHost", 6));
+	// bandwidth caps in KiB/s, 0 = unlimited
+	m_settings->registerSetting(new Setting("NetMaxBandwidth", 0));
+	m_settings->registerSetting(new Setting("NetBackgroundMaxBandwidth", 0));
+	// if set, every finished download job writes a Chrome trace of its requests here
+	m_settings->registerSetting(new Setting("NetTraceDir", ""));
+	// if a forge mirror doesn't answer within this many msecs, also ask the next one. 0 = never
+	m_settings->registerSetting(new Setting("ForgeMirrorHedgeDelay", 0));
+	// only report the assets that would be deleted, don't delete them
+	m_settings->registerSetting(new Setting("AssetsCleanupDryRun", false));
+
 	// The cat
 	m_settings->registerSetting(new Setting("TheCat", false));
 
@@ -383,6 +403,16 @@ std::shared_ptr<ForgeVersionList> MultiMC::forgelist()
 	return m_forgelist;
 }
 
+std::shared_ptr<ForgeMirrorStats> MultiMC::forgeMirrorStats()
+{
+	if (!m_forge_mirror_stats)
+	{
+		m_forge_mirror_stats.reset(new ForgeMirrorStats("forge_mirrors.json"));
+		m_forge_mirror_stats->load();
+	}
+	return m_forge_mirror_stats;
+}
+
 std::shared_ptr<MinecraftVersionList> MultiMC::minecraftlist()
 {
 	if (!m_minecraftlist)
@@ -16,7 +16,9 @@ class InstanceList;
 class MojangAccountList;
 class IconList;
 class QNetworkAccessManager;
+class UrlResolver;
 class ForgeVersionList;
+class ForgeMirrorStats;
 class JavaVersionList;
 
 #if defined(MMC)
@@ -80,6 +82,12 @@ public:
 		return m_qnam;
 	}
 
+	/// the URL rewrites qnam() applies to every request
+	std::shared_ptr<UrlResolver> urlResolver()
+	{
+		return m_url_resolver;
+	}
+
 	std::shared_ptr<HttpMetaCache> metacache()
 	{
 		return m_metacache;
@@ -89,6 +97,8 @@ public:
 
 	std::shared_ptr<ForgeVersionList> forgelist();
 
+	std::shared_ptr<ForgeMirrorStats> forgeMirrorStats();
+
 	std::shared_ptr<MinecraftVersionList> minecraftlist();
 
 	std::shared_ptr<JavaVersionList> javalist();
@@ -110,9 +120,11 @@ private:
 	std::shared_ptr<MojangAccountList> m_accounts;
 	std::shared_ptr<IconList> m_icons;
 	std::shared_ptr<QNetworkAccessManager> m_qnam;
+	std::shared_ptr<UrlResolver> m_url_resolver;
 	std::shared_ptr<HttpMetaCache> m_metacache;
 	std::shared_ptr<LWJGLVersionList> m_lwjgllist;
 	std::shared_ptr<ForgeVersionList> m_forgelist;
+	std::shared_ptr<ForgeMirrorStats> m_forge_mirror_stats;
 	std::shared_ptr<MinecraftVersionList> m_minecraftlist;
 	std::shared_ptr<JavaVersionList> m_javalist;
 	QsLogging::DestinationPtr m_fileDestination;
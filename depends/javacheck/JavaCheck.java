@@ -3,10 +3,14 @@ import java.lang.Integer;
 public class JavaCheck
 {
 	private static final String key = "os.arch";
+	private static final String versionKey = "java.version";
 	public static void main (String [] args)
 	{
 		String property = System.getProperty(key);
 		System.out.println(key + "=" + property);
+		String version = System.getProperty(versionKey);
+		if (version != null)
+			System.out.println(versionKey + "=" + version);
 		if (property != null)
 			System.exit(0);
 		System.exit(1);
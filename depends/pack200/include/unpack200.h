@@ -25,6 +25,13 @@
 
 #pragma once
 #include <string>
+#include <functional>
+#include <stdint.h>
+
+/// Copies up to 'len' bytes of input into 'buf'. Returns the number of bytes copied, 0 at the end.
+typedef std::function<int64_t(void *buf, int64_t len)> unpack_200_input_fn;
+/// Called with every block of data written to the output file, in order.
+typedef std::function<void(const void *buf, int64_t len)> unpack_200_output_fn;
 
 /**
  * @brief Unpack a PACK200 file
@@ -35,3 +42,15 @@
  * @throw std::runtime_error for any error encountered
  */
 void unpack_200(std::string input_path, std::string output_path);
+
+/**
+ * @brief Unpack a PACK200 stream supplied by a callback
+ *
+ * @param input Callback that supplies the PACK200 data.
+ * @param output_path Path to the output file in PACK200 format. System native string encoding.
+ * @param observer If set, sees all the data written to the output file (to hash it, for example).
+ * @return void
+ * @throw std::runtime_error for any error encountered
+ */
+void unpack_200(unpack_200_input_fn input, std::string output_path,
+				unpack_200_output_fn observer = nullptr);
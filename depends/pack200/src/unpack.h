@@ -159,6 +159,7 @@ struct unpacker
 
 	// if running Unix-style, here are the inputs and outputs
 	FILE *infileptr; // buffered
+	void *input_source; // callback input, points to an unpack_200_input_fn
 	bytes inbytes;   // direct
 	gunzip *gzin;	// gunzip filter, if any
 	jar *jarout;	 // output JAR file
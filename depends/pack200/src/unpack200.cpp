@@ -71,6 +71,26 @@ static int64_t read_input_via_stdio(unpacker *u, void *buf, int64_t minlen, int6
 	return numread;
 }
 
+// Callback for fetching data from an unpack_200_input_fn.
+static int64_t read_input_via_callback(unpacker *u, void *buf, int64_t minlen, int64_t maxlen)
+{
+	assert(u->input_source != nullptr);
+	assert(minlen <= maxlen); // don't talk nonsense
+	unpack_200_input_fn &source = *(unpack_200_input_fn *)u->input_source;
+	int64_t numread = 0;
+	char *bufptr = (char *)buf;
+	while (numread < minlen)
+	{
+		int64_t nr = source(bufptr, maxlen - numread);
+		if (nr <= 0)
+			break;
+		numread += nr;
+		bufptr += nr;
+		assert(numread <= maxlen);
+	}
+	return numread;
+}
+
 enum
 {
 	EOF_MAGIC = 0,
@@ -94,33 +114,37 @@ static int read_magic(unpacker *u, char peek[], int peeklen)
 	return magic;
 }
 
-void unpack_200(std::string input_path, std::string output_path)
-{
-	unpacker u;
-	int status = 0;
-
-	FILE *input = fopen(input_path.c_str(), "rb");
-	if (!input)
-	{
-		throw std::runtime_error("Can't open input file" + input_path);
-	}
-	FILE *output = fopen(output_path.c_str(), "wb");
-	if (!output)
-	{
-		fclose(output);
-		throw std::runtime_error("Can't open output file" + output_path);
-	}
-	u.init(read_input_via_stdio);
+static void unpack_all_segments(unpacker &u);
 
+// Unpack all segments from an initialized unpacker into the output file.
+static void unpack_segments(unpacker &u, FILE *output, unpack_200_output_fn *observer)
+{
 	// initialize jar output
 	// the output takes ownership of the file handle
 	jar jarout;
 	jarout.init(&u);
 	jarout.jarfp = output;
+	if (observer && *observer)
+		jarout.write_observer = observer;
 
-	// the input doesn't
-	u.infileptr = input;
+	try
+	{
+		unpack_all_segments(u);
+	}
+	catch (std::runtime_error &)
+	{
+		// don't leak the output file handle
+		if (jarout.jarfp)
+			fclose(jarout.jarfp);
+		jarout.jarfp = nullptr;
+		u.free();
+		throw;
+	}
+}
 
+// Unpack everything the unpacker's input has to offer.
+static void unpack_all_segments(unpacker &u)
+{
 	// read the magic!
 	char peek[4];
 	int magic;
@@ -171,5 +195,44 @@ void unpack_200(std::string input_path, std::string output_path)
 	}
 	u.finish();
 	u.free(); // tidy up malloc blocks
+}
+
+void unpack_200(std::string input_path, std::string output_path)
+{
+	unpacker u;
+
+	FILE *input = fopen(input_path.c_str(), "rb");
+	if (!input)
+	{
+		throw std::runtime_error("Can't open input file" + input_path);
+	}
+	FILE *output = fopen(output_path.c_str(), "wb");
+	if (!output)
+	{
+		fclose(input);
+		throw std::runtime_error("Can't open output file" + output_path);
+	}
+	u.init(read_input_via_stdio);
+
+	// the unpacker does not take ownership of the input
+	u.infileptr = input;
+
+	unpack_segments(u, output, nullptr);
 	fclose(input);
 }
+
+void unpack_200(unpack_200_input_fn input, std::string output_path,
+				unpack_200_output_fn observer)
+{
+	unpacker u;
+
+	FILE *output = fopen(output_path.c_str(), "wb");
+	if (!output)
+	{
+		throw std::runtime_error("Can't open output file" + output_path);
+	}
+	u.init(read_input_via_callback);
+	u.input_source = &input;
+
+	unpack_segments(u, output, &observer);
+}
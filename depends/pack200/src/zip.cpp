@@ -47,6 +47,7 @@
 #include "unpack.h"
 
 #include "zip.h"
+#include "unpack200.h"
 
 #include "zlib.h"
 
@@ -84,6 +85,8 @@ void jar::write_data(void *buff, int len)
 			fprintf(stderr, "Error: write on output file failed err=%d\n", errno);
 			exit(1); // Called only from the native standalone unpacker
 		}
+		if (write_observer)
+			(*(unpack_200_output_fn *)write_observer)(buff, rc);
 		output_file_offset += rc;
 		buff = ((char *)buff) + rc;
 		len -= rc;
@@ -35,6 +35,9 @@ struct jar
 	FILE *jarfp;
 	int default_modtime;
 
+	// if set, sees every block written to jarfp. points to an unpack_200_output_fn
+	void *write_observer;
+
 	// Used by unix2dostime:
 	int modtime_cache;
 	uint32_t dostime_cache;
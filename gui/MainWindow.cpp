@@ -225,11 +225,9 @@ MainWindow::MainWindow(QWidget *parent) : QMainWindow(parent), ui(new Ui::MainWi
 	// run the things that load and download other things... FIXME: this is NOT the place
 	// FIXME: invisible actions in the background = NOPE.
 	{
-		if (!MMC->minecraftlist()->isLoaded())
-		{
-			m_versionLoadTask = MMC->minecraftlist()->getLoadTask();
-			startTask(m_versionLoadTask);
-		}
+		// the list may already be loaded from the cache. refresh it anyway, in the background
+		m_versionLoadTask = MMC->minecraftlist()->getLoadTask();
+		startTask(m_versionLoadTask);
 		if (!MMC->lwjgllist()->isLoaded())
 		{
 			MMC->lwjgllist()->loadList();
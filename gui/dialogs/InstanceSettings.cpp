@@ -110,6 +110,18 @@ void InstanceSettings::applySettings()
 		m_obj->reset("AutoLogin");
 	}
 
+	// Network
+	bool network = ui->networkGroupBox->isChecked();
+	m_obj->set("OverrideNetwork", network);
+	if (network)
+	{
+		m_obj->set("NetMaxBandwidth", ui->maxBandwidthSpinBox->value());
+	}
+	else
+	{
+		m_obj->reset("NetMaxBandwidth");
+	}
+
 	// Memory
 	bool memory = ui->memoryGroupBox->isChecked();
 	m_obj->set("OverrideMemory", memory);
@@ -174,6 +186,10 @@ void InstanceSettings::loadSettings()
 	ui->accountSettingsBox->setChecked(m_obj->get("OverrideLogin").toBool());
 	ui->autoLoginCheckBox->setChecked(m_obj->get("AutoLogin").toBool());
 
+	// Network
+	ui->networkGroupBox->setChecked(m_obj->get("OverrideNetwork").toBool());
+	ui->maxBandwidthSpinBox->setValue(m_obj->get("NetMaxBandwidth").toInt());
+
 	// Memory
 	ui->memoryGroupBox->setChecked(m_obj->get("OverrideMemory").toBool());
 	ui->minMemSpinBox->setValue(m_obj->get("MinMemAlloc").toInt());
@@ -233,6 +249,8 @@ void InstanceSettings::checkFinished(JavaCheckResult result)
 			text += "Using 64bit java.\n";
 		text += "\n";
 		text += "Platform reported: " + result.realPlatform;
+		if (!result.javaVersion.isEmpty())
+			text += "\nJava version: " + result.javaVersion;
 		QMessageBox::information(this, tr("Java test success"), text);
 	}
 	else
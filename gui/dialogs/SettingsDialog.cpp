@@ -153,6 +153,10 @@ void SettingsDialog::applySettings(SettingsObject *s)
 	// Auto Login
 	s->set("AutoLogin", ui->autoLoginCheckBox->isChecked());
 
+	// Network
+	s->set("NetMaxBandwidth", ui->maxBandwidthSpinBox->value());
+	s->set("NetBackgroundMaxBandwidth", ui->backgroundBandwidthSpinBox->value());
+
 	// Memory
 	s->set("MinMemAlloc", ui->minMemSpinBox->value());
 	s->set("MaxMemAlloc", ui->maxMemSpinBox->value());
@@ -205,6 +209,10 @@ void SettingsDialog::loadSettings(SettingsObject *s)
 	// Auto Login
 	ui->autoLoginCheckBox->setChecked(s->get("AutoLogin").toBool());
 
+	// Network
+	ui->maxBandwidthSpinBox->setValue(s->get("NetMaxBandwidth").toInt());
+	ui->backgroundBandwidthSpinBox->setValue(s->get("NetBackgroundMaxBandwidth").toInt());
+
 	// Memory
 	ui->minMemSpinBox->setValue(s->get("MinMemAlloc").toInt());
 	ui->maxMemSpinBox->setValue(s->get("MaxMemAlloc").toInt());
@@ -272,6 +280,8 @@ void SettingsDialog::checkFinished(JavaCheckResult result)
 			text += "Using 64bit java.\n";
 		text += "\n";
 		text += "Platform reported: " + result.realPlatform;
+		if (!result.javaVersion.isEmpty())
+			text += "\nJava version: " + result.javaVersion;
 		QMessageBox::information(this, tr("Java test success"), text);
 	}
 	else
@@ -96,6 +96,11 @@ BaseInstance::BaseInstance(BaseInstancePrivate *d_in, const QString &rootDir,
 		new OverrideSetting("ShowConsole", globalSettings->getSetting("ShowConsole")));
 	settings().registerSetting(new OverrideSetting(
 		"AutoCloseConsole", globalSettings->getSetting("AutoCloseConsole")));
+
+	// Network
+	settings().registerSetting(new Setting("OverrideNetwork", false));
+	settings().registerSetting(
+		new OverrideSetting("NetMaxBandwidth", globalSettings->getSetting("NetMaxBandwidth")));
 }
 
 void BaseInstance::nuke()
@@ -1,21 +1,185 @@
 #include "JavaChecker.h"
 #include <QFile>
+#include <QFileInfo>
+#include <QSaveFile>
+#include <QDateTime>
 #include <QProcess>
+#include <QStandardPaths>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QJsonArray>
+#include <QHash>
+#include <QMap>
+#include "logger/QsLog.h"
+
+#ifndef Q_OS_WIN
+#include <sys/stat.h>
+#endif
 
 #define CHECKER_FILE "JavaChecker.jar"
+#define CHECK_CACHE_FILE "javachecks.json"
+#define CHECK_CACHE_FORMAT_VERSION 1
+
+namespace
+{
+/// what a java binary looked like when it was checked, and what the check said
+struct CachedCheck
+{
+	qint64 size = -1;
+	qint64 mtime = -1;
+	quint64 inode = 0;
+	JavaCheckResult result;
+};
+
+quint64 fileInode(const QString &path)
+{
+#ifndef Q_OS_WIN
+	struct stat info;
+	if (stat(QFile::encodeName(path).constData(), &info) == 0)
+		return info.st_ino;
+#endif
+	return 0;
+}
+
+/// the real file behind 'path', which can also be a bare command name or a symlink
+QString resolveBinary(QString path)
+{
+	if (!path.contains('/') && !path.contains('\\'))
+		path = QStandardPaths::findExecutable(path);
+	if (path.isEmpty())
+		return QString();
+	return QFileInfo(path).canonicalFilePath();
+}
+
+/// the checked binaries by resolved path, loaded from CHECK_CACHE_FILE on first use
+QHash<QString, CachedCheck> &checkCache()
+{
+	static QHash<QString, CachedCheck> cache;
+	static bool loaded = false;
+	if (loaded)
+		return cache;
+	loaded = true;
+
+	QFile file(CHECK_CACHE_FILE);
+	if (!file.open(QIODevice::ReadOnly))
+		return cache;
+	QJsonParseError parseError;
+	QJsonDocument jsonDoc = QJsonDocument::fromJson(file.readAll(), &parseError);
+	file.close();
+	if (parseError.error != QJsonParseError::NoError || !jsonDoc.isObject())
+	{
+		QLOG_WARN() << "Ignoring broken java check cache" << CHECK_CACHE_FILE;
+		return cache;
+	}
+	QJsonObject root = jsonDoc.object();
+	if (root.value("formatVersion").toVariant().toInt() != CHECK_CACHE_FORMAT_VERSION)
+		return cache;
+	for (auto checkVal : root.value("checks").toArray())
+	{
+		QJsonObject checkObj = checkVal.toObject();
+		QString path = checkObj.value("path").toString();
+		if (path.isEmpty())
+			continue;
+		CachedCheck check;
+		check.size = checkObj.value("size").toVariant().toLongLong();
+		check.mtime = checkObj.value("mtime").toVariant().toLongLong();
+		check.inode = checkObj.value("inode").toVariant().toULongLong();
+		check.result.valid = checkObj.value("valid").toBool();
+		check.result.is_64bit = checkObj.value("is_64bit").toBool();
+		check.result.mojangPlatform = check.result.is_64bit ? "64" : "32";
+		check.result.realPlatform = checkObj.value("realPlatform").toString();
+		check.result.javaVersion = checkObj.value("javaVersion").toString();
+		cache[path] = check;
+	}
+	return cache;
+}
+
+void saveCheckCache()
+{
+	QJsonArray checks;
+	auto &cache = checkCache();
+	for (auto iter = cache.begin(); iter != cache.end(); iter++)
+	{
+		QJsonObject checkObj;
+		checkObj.insert("path", iter.key());
+		// as strings, because JSON numbers are doubles
+		checkObj.insert("size", QString::number(iter.value().size));
+		checkObj.insert("mtime", QString::number(iter.value().mtime));
+		checkObj.insert("inode", QString::number(iter.value().inode));
+		checkObj.insert("valid", iter.value().result.valid);
+		checkObj.insert("is_64bit", iter.value().result.is_64bit);
+		checkObj.insert("realPlatform", iter.value().result.realPlatform);
+		checkObj.insert("javaVersion", iter.value().result.javaVersion);
+		checks.append(checkObj);
+	}
+	QJsonObject root;
+	root.insert("formatVersion", CHECK_CACHE_FORMAT_VERSION);
+	root.insert("checks", checks);
+
+	// all at once, so a crash halfway through doesn't throw away every check
+	QSaveFile file(CHECK_CACHE_FILE);
+	if (!file.open(QIODevice::WriteOnly) || file.write(QJsonDocument(root).toJson()) < 0 ||
+		!file.commit())
+	{
+		QLOG_ERROR() << "Failed to write the java check cache to" << CHECK_CACHE_FILE;
+	}
+}
+
+/// the binary as it is on disk right now
+CachedCheck describeBinary(const QString &binary)
+{
+	CachedCheck check;
+	QFileInfo info(binary);
+	check.size = info.size();
+	check.mtime = info.lastModified().toUTC().toMSecsSinceEpoch();
+	check.inode = fileInode(binary);
+	return check;
+}
+}
 
 JavaChecker::JavaChecker(QObject *parent) : QObject(parent)
 {
 }
 
+void JavaChecker::performCachedCheck(QString path)
+{
+	QString binary = resolveBinary(path);
+	if (!binary.isEmpty())
+	{
+		auto &cache = checkCache();
+		auto iter = cache.find(binary);
+		CachedCheck current = describeBinary(binary);
+		if (iter != cache.end() && (*iter).size == current.size &&
+			(*iter).mtime == current.mtime && (*iter).inode == current.inode)
+		{
+			QLOG_INFO() << "Java binary" << binary << "didn't change since it was last checked";
+			m_cached_result = (*iter).result;
+			QTimer::singleShot(0, this, SLOT(cachedFinished()));
+			return;
+		}
+	}
+	performCheck(path);
+}
+
+void JavaChecker::cachedFinished()
+{
+	emit checkFinished(m_cached_result);
+}
+
 int JavaChecker::performCheck(QString path)
 {
-	if(QFile::exists(CHECKER_FILE))
+	m_binary = resolveBinary(path);
+	// extract the checker, once per run. other checks may be using it right now.
+	static bool extracted = false;
+	if (!extracted)
 	{
-		QFile::remove(CHECKER_FILE);
+		if(QFile::exists(CHECKER_FILE))
+		{
+			QFile::remove(CHECKER_FILE);
+		}
+		QFile(":/java/checker.jar").copy(CHECKER_FILE);
+		extracted = true;
 	}
-	// extract the checker
-	QFile(":/java/checker.jar").copy(CHECKER_FILE);
 
 	QStringList args = {"-jar", CHECKER_FILE};
 
@@ -46,15 +210,22 @@ void JavaChecker::finished(int exitcode, QProcess::ExitStatus status)
 		return;
 	}
 
+	// one 'key=value' line per property
+	QMap<QString, QString> properties;
 	QString p_stdout = _process->readAllStandardOutput();
-	auto parts = p_stdout.split('=', QString::SkipEmptyParts);
-	if (parts.size() != 2 || parts[0] != "os.arch")
+	for (auto line : p_stdout.split('\n', QString::SkipEmptyParts))
+	{
+		int pos = line.indexOf('=');
+		if (pos > 0)
+			properties[line.left(pos)] = line.mid(pos + 1).remove('\r');
+	}
+	if (!properties.contains("os.arch"))
 	{
 		emit checkFinished({});
 		return;
 	}
 
-	auto os_arch = parts[1].remove('\n').remove('\r');
+	auto os_arch = properties["os.arch"];
 	bool is_64 = os_arch == "x86_64" || os_arch == "amd64";
 
 	JavaCheckResult result;
@@ -63,6 +234,15 @@ void JavaChecker::finished(int exitcode, QProcess::ExitStatus status)
 		result.is_64bit = is_64;
 		result.mojangPlatform = is_64 ? "64" : "32";
 		result.realPlatform = os_arch;
+		result.javaVersion = properties.value("java.version");
+	}
+	// only good results are remembered. a failure may have been a fluke, like a slow disk
+	if (!m_binary.isEmpty())
+	{
+		CachedCheck check = describeBinary(m_binary);
+		check.result = result;
+		checkCache()[m_binary] = check;
+		saveCheckCache();
 	}
 	emit checkFinished(result);
 }
@@ -80,9 +260,9 @@ void JavaChecker::error(QProcess::ProcessError err)
 void JavaChecker::timeout()
 {
 	// NO MERCY. NO ABUSE.
+	// finished() reports the failure, so everyone waiting on the check gets an answer
 	if(process)
 	{
 		process->kill();
-		process.reset();
 	}
 }
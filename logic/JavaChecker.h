@@ -7,6 +7,7 @@ struct JavaCheckResult
 {
 	QString mojangPlatform;
 	QString realPlatform;
+	QString javaVersion;
 	bool valid = false;
 	bool is_64bit = false;
 };
@@ -18,15 +19,27 @@ class JavaChecker : public QObject
 public:
 	explicit JavaChecker(QObject *parent = 0);
 	int performCheck(QString path);
+	/**
+	 * Like performCheck(), but if the same java binary was checked before and didn't change
+	 * since (same size, modification time and inode), the old result is used and no java
+	 * process is started. checkFinished() is emitted later either way.
+	 */
+	void performCachedCheck(QString path);
 
 signals:
 	void checkFinished(JavaCheckResult result);
 private:
 	QProcessPtr process;
 	QTimer killTimer;
+	/// the binary being checked, as it was found on disk. empty if it wasn't
+	QString m_binary;
+	JavaCheckResult m_cached_result;
 public
 slots:
 	void timeout();
 	void finished(int exitcode, QProcess::ExitStatus);
 	void error(QProcess::ProcessError);
+private
+slots:
+	void cachedFinished();
 };
@@ -16,6 +16,9 @@
 #include <QStringList>
 #include <QString>
 #include <QDir>
+#include <QFileInfo>
+#include <QSet>
+#include <QStandardPaths>
 #include <QMessageBox>
 
 #include <setting.h>
@@ -179,10 +182,65 @@ QList<JavaVersionPtr> JavaUtils::FindJavaPaths()
 #elif LINUX
 QList<JavaVersionPtr> JavaUtils::FindJavaPaths()
 {
-	QLOG_INFO() << "Linux Java detection incomplete - defaulting to \"java\"";
-
 	QList<JavaVersionPtr> javas;
-	javas.append(this->GetDefaultJava());
+	// the same java can be reachable in many ways (PATH, alternatives, JAVA_HOME, ...)
+	QSet<QString> seen;
+	auto addJava = [&](JavaVersionPtr java, QString binary)
+	{
+		QFileInfo info(binary);
+		if (!info.isFile() || !info.isExecutable())
+			return;
+		QString real = info.canonicalFilePath();
+		if (seen.contains(real))
+			return;
+		seen.insert(real);
+		javas.append(java);
+	};
+
+	// whatever 'java' runs is what the user gets by default
+	QString default_binary = QStandardPaths::findExecutable("java");
+	if (!default_binary.isEmpty())
+	{
+		auto java = this->GetDefaultJava();
+		java->recommended = true;
+		addJava(java, default_binary);
+	}
+
+	QStringList homes;
+	QString java_home = QString::fromLocal8Bit(qgetenv("JAVA_HOME"));
+	if (!java_home.isEmpty())
+		homes.append(java_home);
+	QStringList roots = {"/usr/lib/jvm", "/usr/lib64/jvm", "/usr/lib32/jvm", "/usr/java",
+						 "/opt/java"};
+	for (auto root : roots)
+	{
+		QDir dir(root);
+		for (auto entry : dir.entryList(QDir::Dirs | QDir::NoDotAndDotDot, QDir::Name))
+			homes.append(dir.absoluteFilePath(entry));
+	}
+	for (auto home : homes)
+	{
+		for (auto binary : {PathCombine(home, "bin/java"), PathCombine(home, "jre/bin/java")})
+		{
+			JavaVersionPtr java(new JavaVersion());
+			java->id = QDir(home).dirName();
+			java->arch = "unknown";
+			java->path = binary;
+			java->recommended = false;
+			addJava(java, binary);
+		}
+	}
+
+	if (javas.isEmpty())
+	{
+		QLOG_WARN() << "Failed to find any Java installation - defaulting to \"java\"";
+		javas.append(this->GetDefaultJava());
+		return javas;
+	}
+
+	QLOG_INFO() << "Found the following Java installations:";
+	for (auto &java : javas)
+		QLOG_INFO() << java->id << " at " << java->path;
 
 	return javas;
 }
@@ -20,11 +20,22 @@
 #include "LegacyInstance.h"
 #include "MultiMC.h"
 #include "ModList.h"
+#include "net/URLConstants.h"
+#include "net/FileSink.h"
 #include <pathutils.h>
 #include <quazip.h>
 #include <quazipfile.h>
 #include <JlCompress.h>
 #include "logger/QsLog.h"
+#include <QDirIterator>
+#include <QCryptographicHash>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QJsonArray>
+#include <QSaveFile>
+#include <QHash>
+#include <QSet>
+#include <algorithm>
 
 LegacyUpdate::LegacyUpdate(BaseInstance *inst, bool prepare_for_launch, QObject *parent)
 	: Task(parent), m_inst(inst), m_prepare_for_launch(prepare_for_launch)
@@ -245,12 +256,14 @@ void LegacyUpdate::jarStart()
 	// Build a list of URLs that will need to be downloaded.
 	setStatus("Downloading new minecraft.jar");
 
-	QString urlstr("http://s3.amazonaws.com/Minecraft.Download/versions/");
+	QString urlstr = URLConstants::MOJANG_VERSIONS_BASE;
 	QString intended_version_id = inst->intendedVersionId();
 	urlstr += intended_version_id + "/" + intended_version_id + ".jar";
 
 	auto dljob = new NetJob("Minecraft.jar for version " + intended_version_id);
 	dljob->addNetAction(FileDownload::make(QUrl(urlstr), inst->defaultBaseJar()));
+	if (inst->settings().get("OverrideNetwork").toBool())
+		dljob->setBandwidthLimit(inst->settings().get("NetMaxBandwidth").toInt());
 	legacyDownloadJob.reset(dljob);
 	connect(dljob, SIGNAL(succeeded()), SLOT(jarFinished()));
 	connect(dljob, SIGNAL(failed()), SLOT(jarFailed()));
@@ -270,65 +283,255 @@ void LegacyUpdate::jarFailed()
 	emitFailed("Failed to download the minecraft jar. Try again later.");
 }
 
-bool LegacyUpdate::MergeZipFiles(QuaZip *into, QFileInfo from, QSet<QString> &contained,
-								 MetainfAction metainf)
-{
-	setStatus("Installing mods - Adding " + from.fileName());
+#define JAR_MANIFEST_FORMAT_VERSION 1
 
-	QuaZip modZip(from.filePath());
-	modZip.open(QuaZip::mdUnzip);
+namespace
+{
+/// something that puts files into the modded jar
+struct JarSource
+{
+	enum Type
+	{
+		Zip,
+		File,
+		Folder
+	} type;
+	/// the file or folder, absolute
+	QString path;
+	/// for folders: entry names are relative to this
+	QString root;
+	/// for zips: whether its META-INF goes into the jar
+	bool metainf = true;
+	/// changes whenever the contents might have changed
+	QString signature;
+	/// the names it provides, in the jar
+	QStringList entries;
+};
+
+JarSource makeSource(JarSource::Type type, QFileInfo file, bool metainf = true)
+{
+	JarSource source;
+	source.type = type;
+	source.path = file.absoluteFilePath();
+	source.metainf = metainf;
+	source.signature = QString("%1|%2|%3|%4|%5")
+						   .arg(type)
+						   .arg(source.path)
+						   .arg(metainf)
+						   .arg(file.size())
+						   .arg(file.lastModified().toUTC().toMSecsSinceEpoch());
+	return source;
+}
 
-	QuaZipFile fileInsideMod(&modZip);
-	QuaZipFile zipOutFile(into);
-	for (bool more = modZip.goToFirstFile(); more; more = modZip.goToNextFile())
+/// fill in the entries of a source. folders also get their signature completed here
+bool listSource(JarSource &source)
+{
+	switch (source.type)
 	{
-		QString filename = modZip.getCurrentFileName();
-		if (filename.contains("META-INF") && metainf == LegacyUpdate::IgnoreMetainf)
+	case JarSource::Zip:
+	{
+		QuaZip zip(source.path);
+		if (!zip.open(QuaZip::mdUnzip))
+			return false;
+		for (bool more = zip.goToFirstFile(); more; more = zip.goToNextFile())
 		{
-			QLOG_INFO() << "Skipping META-INF " << filename << " from " << from.fileName();
-			continue;
+			QString name = zip.getCurrentFileName();
+			if (!source.metainf && name.contains("META-INF"))
+				continue;
+			source.entries.append(name);
 		}
-		if (contained.contains(filename))
+		zip.close();
+		return zip.getZipError() == UNZ_OK;
+	}
+	case JarSource::File:
+		source.entries.append(QFileInfo(source.path).fileName());
+		return true;
+	case JarSource::Folder:
+	{
+		// the folder itself is part of the names, like it always was
+		QDir folder(source.path);
+		folder.cdUp();
+		source.root = folder.absolutePath();
+		QDirIterator iter(source.path, QDir::Files, QDirIterator::Subdirectories);
+		while (iter.hasNext())
+			source.entries.append(folder.relativeFilePath(iter.next()));
+		source.entries.sort();
+		QCryptographicHash hash(QCryptographicHash::Sha1);
+		for (auto name : source.entries)
 		{
-			QLOG_INFO() << "Skipping already contained file " << filename << " from "
-						<< from.fileName();
-			continue;
+			QFileInfo info(folder.absoluteFilePath(name));
+			hash.addData(QString("%1|%2|%3\n")
+							 .arg(name)
+							 .arg(info.size())
+							 .arg(info.lastModified().toUTC().toMSecsSinceEpoch())
+							 .toUtf8());
 		}
-		contained.insert(filename);
-		QLOG_INFO() << "Adding file " << filename << " from " << from.fileName();
+		source.signature += "|" + QString(hash.result().toHex());
+		return true;
+	}
+	}
+	return false;
+}
 
-		if (!fileInsideMod.open(QIODevice::ReadOnly))
+/// copy the current entry of 'from' into 'into', without recompressing it
+bool copyZipEntry(QuaZip *from, QuaZip *into)
+{
+	QString filename = from->getCurrentFileName();
+	QuaZipFileInfo old_info;
+	if (!from->getCurrentFileInfo(&old_info))
+	{
+		QLOG_ERROR() << "Failed to read " << filename << " from " << from->getZipName();
+		return false;
+	}
+	QuaZipFile fileInsideMod(from);
+	QuaZipFile zipOutFile(into);
+	// the compressed data is copied as it is, with its CRC and sizes. no need to inflate
+	// and deflate it all again. encrypted entries can't be, but jars don't have those.
+	bool raw = !(old_info.flags & 1);
+	int method = 0;
+	int level = 0;
+	if (!fileInsideMod.open(QIODevice::ReadOnly, &method, &level, raw))
+	{
+		QLOG_ERROR() << "Failed to open " << filename << " from " << from->getZipName();
+		return false;
+	}
+	QuaZipNewInfo info_out(fileInsideMod.getActualFileName());
+	bool opened;
+	if (raw)
+	{
+		info_out.uncompressedSize = old_info.uncompressedSize;
+		opened = zipOutFile.open(QIODevice::WriteOnly, info_out, NULL, old_info.crc, method,
+								 level, true);
+	}
+	else
+	{
+		opened = zipOutFile.open(QIODevice::WriteOnly, info_out);
+	}
+	if (!opened)
+	{
+		QLOG_ERROR() << "Failed to open " << filename << " in the jar";
+		fileInsideMod.close();
+		return false;
+	}
+	bool copied;
+	if (raw)
+	{
+		// atEnd() doesn't work in raw mode, so copy exactly the compressed size
+		copied = true;
+		char buf[65536];
+		qint64 left = old_info.compressedSize;
+		while (copied && left > 0)
 		{
-			QLOG_ERROR() << "Failed to open " << filename << " from " << from.fileName();
-			return false;
+			qint64 count = fileInsideMod.read(buf, std::min<qint64>(left, sizeof(buf)));
+			copied = count > 0 && zipOutFile.write(buf, count) == count;
+			left -= count;
 		}
-		/*
-		QuaZipFileInfo old_info;
-		fileInsideMod.getFileInfo(&old_info);
-		*/
-		QuaZipNewInfo info_out(fileInsideMod.getActualFileName());
-		/*
-		info_out.externalAttr = old_info.externalAttr;
-		*/
-		if (!zipOutFile.open(QIODevice::WriteOnly, info_out))
-		{
-			QLOG_ERROR() << "Failed to open " << filename << " in the jar";
-			fileInsideMod.close();
+	}
+	else
+	{
+		copied = JlCompress::copyData(fileInsideMod, zipOutFile);
+	}
+	zipOutFile.close();
+	fileInsideMod.close();
+	if (!copied || zipOutFile.getZipError() != UNZ_OK)
+	{
+		QLOG_ERROR() << "Failed to copy data of " << filename << " into the jar";
+		return false;
+	}
+	return true;
+}
+
+/// copy the 'wanted' entries of the zip at 'path'. the names that were there end up in 'done'
+bool copyZipEntries(QString path, QuaZip *into, const QSet<QString> &wanted, QSet<QString> &done)
+{
+	QuaZip zip(path);
+	if (!zip.open(QuaZip::mdUnzip))
+		return false;
+	// a zip can have the same name twice. the first one counts.
+	for (bool more = zip.goToFirstFile(); more; more = zip.goToNextFile())
+	{
+		QString name = zip.getCurrentFileName();
+		if (!wanted.contains(name) || done.contains(name))
+			continue;
+		done.insert(name);
+		if (!copyZipEntry(&zip, into))
 			return false;
-		}
-		if (!JlCompress::copyData(fileInsideMod, zipOutFile))
+	}
+	return true;
+}
+
+/// the sources the jar was built from, as written by saveJarManifest()
+struct JarManifest
+{
+	qint64 jar_size = -1;
+	qint64 jar_mtime = -1;
+	/// signature -> entries
+	QHash<QString, QStringList> sources;
+	/// entry -> signature of the source it came from
+	QHash<QString, QString> winners;
+};
+
+bool loadJarManifest(QString path, JarManifest &manifest)
+{
+	QFile file(path);
+	if (!file.open(QIODevice::ReadOnly))
+		return false;
+	QJsonParseError parseError;
+	QJsonDocument jsonDoc = QJsonDocument::fromJson(file.readAll(), &parseError);
+	file.close();
+	if (parseError.error != QJsonParseError::NoError || !jsonDoc.isObject())
+	{
+		QLOG_WARN() << "Ignoring broken jar manifest" << path;
+		return false;
+	}
+	QJsonObject root = jsonDoc.object();
+	if (root.value("formatVersion").toVariant().toInt() != JAR_MANIFEST_FORMAT_VERSION)
+		return false;
+	manifest.jar_size = root.value("jarSize").toVariant().toLongLong();
+	manifest.jar_mtime = root.value("jarModified").toVariant().toLongLong();
+	for (auto sourceVal : root.value("sources").toArray())
+	{
+		QJsonObject sourceObj = sourceVal.toObject();
+		QString signature = sourceObj.value("signature").toString();
+		QStringList entries;
+		for (auto entryVal : sourceObj.value("entries").toArray())
 		{
-			zipOutFile.close();
-			fileInsideMod.close();
-			QLOG_ERROR() << "Failed to copy data of " << filename << " into the jar";
-			return false;
+			QString entry = entryVal.toString();
+			entries.append(entry);
+			if (!manifest.winners.contains(entry))
+				manifest.winners[entry] = signature;
 		}
-		zipOutFile.close();
-		fileInsideMod.close();
+		manifest.sources[signature] = entries;
 	}
 	return true;
 }
 
+bool saveJarManifest(QString path, QFileInfo jar, const QList<JarSource> &sources)
+{
+	QJsonArray sourcesArr;
+	for (auto &source : sources)
+	{
+		QJsonObject sourceObj;
+		sourceObj.insert("signature", source.signature);
+		sourceObj.insert("entries", QJsonArray::fromStringList(source.entries));
+		sourcesArr.append(sourceObj);
+	}
+	QJsonObject root;
+	root.insert("formatVersion", JAR_MANIFEST_FORMAT_VERSION);
+	// as strings, because JSON numbers are doubles
+	root.insert("jarSize", QString::number(jar.size()));
+	root.insert("jarModified",
+				QString::number(jar.lastModified().toUTC().toMSecsSinceEpoch()));
+	root.insert("sources", sourcesArr);
+
+	QSaveFile file(path);
+	if (!file.open(QIODevice::WriteOnly))
+		return false;
+	file.write(QJsonDocument(root).toJson());
+	return file.commit();
+}
+}
+
 void LegacyUpdate::ModTheJar()
 {
 	LegacyInstance *inst = (LegacyInstance *)m_inst;
@@ -377,93 +580,173 @@ void LegacyUpdate::ModTheJar()
 		return;
 	}
 
-	if (runnableJar.exists() && !QFile::remove(runnableJar.filePath()))
+	// where the mods go, in the order they take precedence: the last mod in the list wins,
+	// and minecraft.jar fills in the rest
+	QList<JarSource> sources;
+	for (int i = modList->size() - 1; i >= 0; i--)
 	{
-		emitFailed("Failed to delete old minecraft.jar");
-		return;
+		auto &mod = modList->operator[](i);
+		if (mod.type() == Mod::MOD_ZIPFILE)
+			sources.append(makeSource(JarSource::Zip, mod.filename()));
+		else if (mod.type() == Mod::MOD_SINGLEFILE)
+			sources.append(makeSource(JarSource::File, mod.filename()));
+		else if (mod.type() == Mod::MOD_FOLDER)
+			sources.append(makeSource(JarSource::Folder, mod.filename()));
 	}
+	sources.append(makeSource(JarSource::Zip, baseJar, false));
+
+	// what the current jar was built from. if the jar is still the one we built,
+	// everything that would come from the same place again can be taken from it.
+	QString manifestPath = runnableJar.filePath() + ".manifest";
+	JarManifest manifest;
+	bool have_old_jar = runnableJar.isFile() && loadJarManifest(manifestPath, manifest) &&
+						manifest.jar_size == runnableJar.size() &&
+						manifest.jar_mtime ==
+							runnableJar.lastModified().toUTC().toMSecsSinceEpoch();
 
 	// TaskStep(); // STEP 1
-	setStatus("Installing mods - Opening minecraft.jar");
+	setStatus("Installing mods - Looking at the mods");
+	QHash<QString, int> winners;
+	for (int i = 0; i < sources.size(); i++)
+	{
+		auto &source = sources[i];
+		if (have_old_jar && source.type != JarSource::Folder &&
+			manifest.sources.contains(source.signature))
+		{
+			source.entries = manifest.sources[source.signature];
+		}
+		else if (!listSource(source))
+		{
+			emitFailed("Failed to read " + QFileInfo(source.path).fileName());
+			return;
+		}
+		for (auto entry : source.entries)
+		{
+			if (!winners.contains(entry))
+				winners[entry] = i;
+		}
+	}
+
+	// sort out what has to come from where
+	QSet<QString> reused;
+	QList<QSet<QString>> wanted;
+	for (int i = 0; i < sources.size(); i++)
+		wanted.append(QSet<QString>());
+	for (auto iter = winners.begin(); iter != winners.end(); iter++)
+	{
+		auto &signature = sources[iter.value()].signature;
+		if (have_old_jar && manifest.winners.value(iter.key()) == signature)
+			reused.insert(iter.key());
+		else
+			wanted[iter.value()].insert(iter.key());
+	}
+	QLOG_INFO() << "Rebuilding minecraft.jar:" << reused.size() << "entries can be reused,"
+				<< winners.size() - reused.size() << "have to be added";
 
-	QuaZip zipOut(runnableJar.filePath());
+	setStatus("Installing mods - Opening minecraft.jar");
+	QString newJarPath = runnableJar.filePath() + ".new";
+	QuaZip zipOut(newJarPath);
 	if (!zipOut.open(QuaZip::mdCreate))
 	{
-		QFile::remove(runnableJar.filePath());
+		QFile::remove(newJarPath);
 		emitFailed("Failed to open the minecraft.jar for modding");
 		return;
 	}
-	// Files already added to the jar.
-	// These files will be skipped.
-	QSet<QString> addedFiles;
+	auto fail = [&](QString reason)
+	{
+		zipOut.close();
+		QFile::remove(newJarPath);
+		emitFailed(reason);
+	};
+
+	if (!reused.isEmpty())
+	{
+		setStatus("Installing mods - Keeping unchanged files");
+		QSet<QString> done;
+		if (!copyZipEntries(runnableJar.filePath(), &zipOut, reused, done))
+		{
+			fail("Failed to reuse the contents of the old minecraft.jar");
+			return;
+		}
+		// the old jar doesn't have everything the manifest says. get the rest from the mods
+		QSet<QString> missing = reused - done;
+		if (!missing.isEmpty())
+		{
+			QLOG_WARN() << missing.size() << "entries are missing from the old minecraft.jar,"
+						<< "adding them from their sources";
+			for (auto entry : missing)
+				wanted[winners[entry]].insert(entry);
+		}
+	}
 
 	// Modify the jar
 	setStatus("Installing mods - Adding mod files...");
-	for (int i = modList->size() - 1; i >= 0; i--)
+	for (int i = 0; i < sources.size(); i++)
 	{
-		auto &mod = modList->operator[](i);
-		if (mod.type() == Mod::MOD_ZIPFILE)
+		auto &source = sources[i];
+		if (wanted[i].isEmpty())
+			continue;
+		QString name = QFileInfo(source.path).fileName();
+		setStatus("Installing mods - Adding " + name);
+		QLOG_INFO() << "Adding" << wanted[i].size() << "files from" << source.path;
+		bool ok = true;
+		if (source.type == JarSource::Zip)
 		{
-			if (!MergeZipFiles(&zipOut, mod.filename(), addedFiles, LegacyUpdate::KeepMetainf))
+			QSet<QString> done;
+			ok = copyZipEntries(source.path, &zipOut, wanted[i], done);
+			if (ok && done != wanted[i])
 			{
-				zipOut.close();
-				QFile::remove(runnableJar.filePath());
-				emitFailed("Failed to add " + mod.filename().fileName() + " to the jar.");
-				return;
+				// the list of entries came from an outdated manifest. don't trust it again
+				QLOG_ERROR() << source.path << "lacks" << (wanted[i] - done).size()
+							 << "of the entries it was supposed to have";
+				QFile::remove(manifestPath);
+				ok = false;
 			}
 		}
-		else if (mod.type() == Mod::MOD_SINGLEFILE)
+		else if (source.type == JarSource::File)
 		{
-			auto filename = mod.filename();
-			if (!JlCompress::compressFile(&zipOut, filename.absoluteFilePath(),
-										  filename.fileName()))
-			{
-				zipOut.close();
-				QFile::remove(runnableJar.filePath());
-				emitFailed("Failed to add " + filename.fileName() + " to the jar");
-				return;
-			}
-			addedFiles.insert(filename.fileName());
-			QLOG_INFO() << "Adding file " << filename.fileName() << " from "
-						<< filename.absoluteFilePath();
+			ok = JlCompress::compressFile(&zipOut, source.path, name);
 		}
-		else if (mod.type() == Mod::MOD_FOLDER)
+		else
 		{
-			auto filename = mod.filename();
-			QString what_to_zip = filename.absoluteFilePath();
-			QDir dir(what_to_zip);
-			dir.cdUp();
-			QString parent_dir = dir.absolutePath();
-			if (!JlCompress::compressSubDir(&zipOut, what_to_zip, parent_dir, true, addedFiles))
+			QDir root(source.root);
+			for (auto entry : wanted[i])
 			{
-				zipOut.close();
-				QFile::remove(runnableJar.filePath());
-				emitFailed("Failed to add " + filename.fileName() + " to the jar");
-				return;
+				ok = JlCompress::compressFile(&zipOut, root.absoluteFilePath(entry), entry);
+				if (!ok)
+					break;
 			}
-			QLOG_INFO() << "Adding folder " << filename.fileName() << " from "
-						<< filename.absoluteFilePath();
 		}
-	}
-
-	if (!MergeZipFiles(&zipOut, baseJar, addedFiles, LegacyUpdate::IgnoreMetainf))
-	{
-		zipOut.close();
-		QFile::remove(runnableJar.filePath());
-		emitFailed("Failed to insert minecraft.jar contents.");
-		return;
+		if (!ok)
+		{
+			if (i == sources.size() - 1)
+				fail("Failed to insert minecraft.jar contents.");
+			else
+				fail("Failed to add " + name + " to the jar.");
+			return;
+		}
 	}
 
 	// Recompress the jar
 	zipOut.close();
 	if (zipOut.getZipError() != 0)
 	{
-		QFile::remove(runnableJar.filePath());
+		QFile::remove(newJarPath);
 		emitFailed("Failed to finalize minecraft.jar!");
 		return;
 	}
+	// the old jar stays until the new one is complete
+	QFile::remove(manifestPath);
+	if (!FileSink::replaceFile(newJarPath, runnableJar.filePath()))
+	{
+		QFile::remove(newJarPath);
+		emitFailed("Failed to replace the old minecraft.jar");
+		return;
+	}
+	if (!saveJarManifest(manifestPath, QFileInfo(runnableJar.filePath()), sources))
+		QLOG_WARN() << "Failed to save" << manifestPath << "- the next rebuild will be a full one";
 	inst->setShouldRebuild(false);
 	// inst->UpdateVersion(true);
 	emitSucceeded();
 	return;
-}
\ No newline at end of file
+}
@@ -24,7 +24,6 @@
 
 class MinecraftVersion;
 class BaseInstance;
-class QuaZip;
 class Mod;
 
 class LegacyUpdate : public Task
@@ -48,15 +47,6 @@ slots:
 
 	void ModTheJar();
 
-private:
-	enum MetainfAction
-	{
-		KeepMetainf,  // the META-INF folder will be added from the merged jar
-		IgnoreMetainf // the META-INF from the merged jar will be ignored
-	};
-	bool MergeZipFiles(QuaZip *into, QFileInfo from, QSet<QString> &contained,
-					   MetainfAction metainf);
-
 private:
 
 	std::shared_ptr<QNetworkReply> m_reply;
@@ -0,0 +1,211 @@
+/* Copyright 2013 MultiMC Contributors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "NativesCache.h"
+#include "net/HttpMetaCache.h"
+
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QDirIterator>
+#include <QCryptographicHash>
+#include <QTemporaryDir>
+#include <QSaveFile>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QJsonArray>
+#include <QSet>
+#include <QRegExp>
+#include <JlCompress.h>
+#include "logger/QsLog.h"
+#include "pathutils.h"
+
+#ifndef Q_OS_WIN
+#include <unistd.h>
+#endif
+
+// bump this to throw away everything extracted by older versions
+#define NATIVES_CACHE_FORMAT_VERSION 1
+
+const QFile::Permissions read_only = QFile::ReadOwner | QFile::ReadUser | QFile::ReadGroup |
+									 QFile::ReadOther;
+const QFile::Permissions writable = read_only | QFile::WriteOwner | QFile::WriteUser;
+
+namespace NativesCache
+{
+static bool hardLink(const QString &source, const QString &target)
+{
+#ifdef Q_OS_WIN
+	// the read-only attribute belongs to the file, not the link, so a read-only link can't be
+	// deleted without making the cached file writable. copies it is.
+	Q_UNUSED(source);
+	Q_UNUSED(target);
+	return false;
+#else
+	return ::link(QFile::encodeName(source).constData(),
+				  QFile::encodeName(target).constData()) == 0;
+#endif
+}
+
+static void setPermissions(const QString &dir, QFile::Permissions permissions)
+{
+	QDirIterator iter(dir, QDir::Files | QDir::Hidden | QDir::NoDotAndDotDot,
+					  QDirIterator::Subdirectories);
+	while (iter.hasNext())
+		QFile::setPermissions(iter.next(), permissions);
+}
+
+static QString indexPath()
+{
+	return QDir("natives").absoluteFilePath("index.json");
+}
+
+static QJsonObject loadIndex()
+{
+	QFile file(indexPath());
+	if (!file.open(QIODevice::ReadOnly))
+		return QJsonObject();
+	return QJsonDocument::fromJson(file.readAll()).object();
+}
+
+static void saveIndex(const QJsonObject &index)
+{
+	QSaveFile file(indexPath());
+	if (!file.open(QIODevice::WriteOnly) ||
+		file.write(QJsonDocument(index).toJson()) < 0 || !file.commit())
+	{
+		QLOG_ERROR() << "Can't save the natives cache index";
+	}
+}
+
+QString extracted(QString storage, QString jar_path, QString md5, QStringList excludes)
+{
+	if (md5.isEmpty())
+		md5 = HttpMetaCache::fileMd5(jar_path);
+	if (md5.isEmpty())
+	{
+		QLOG_ERROR() << "Can't read the native library" << jar_path;
+		return QString();
+	}
+	excludes.sort();
+	QCryptographicHash key(QCryptographicHash::Sha1);
+	key.addData(QString::number(NATIVES_CACHE_FORMAT_VERSION).toUtf8());
+	key.addData("\n" + storage.toUtf8());
+	key.addData("\n" + md5.toUtf8());
+	for (auto exclude : excludes)
+		key.addData("\n" + exclude.toUtf8());
+
+	QDir root("natives");
+	QString folder = root.absoluteFilePath(QString(key.result().toHex()));
+	// the folder only ever appears complete, so if it's there, it's good
+	if (QFileInfo(folder).isDir())
+		return folder;
+
+	if (!root.mkpath("."))
+		return QString();
+	QTemporaryDir temp(root.absoluteFilePath("extracting-XXXXXX"));
+	if (!temp.isValid())
+		return QString();
+	QLOG_INFO() << "Extracting" << jar_path << "to the natives cache";
+	if (JlCompress::extractWithExceptions(jar_path, temp.path(), excludes).isEmpty())
+		return QString();
+	// instances get hard links to these files. writing to one would change them for everyone
+	setPermissions(temp.path(), read_only);
+	if (!QDir().rename(temp.path(), folder))
+	{
+		// somebody else was quicker. theirs is just as good.
+		if (!QFileInfo(folder).isDir())
+			return QString();
+	}
+	else
+	{
+		temp.setAutoRemove(false);
+	}
+	return folder;
+}
+
+bool linkInto(QString source_dir, QString target_dir)
+{
+	QDir source(source_dir);
+	QDirIterator iter(source_dir, QDir::Files | QDir::Hidden | QDir::NoDotAndDotDot,
+					  QDirIterator::Subdirectories);
+	while (iter.hasNext())
+	{
+		QString file = iter.next();
+		QString target = PathCombine(target_dir, source.relativeFilePath(file));
+		if (!ensureFilePathExists(target))
+			return false;
+		// later libraries win, like they did when everything was extracted in one place
+		if (QFile::exists(target))
+			QFile::remove(target);
+		if (hardLink(file, target))
+			continue;
+		// different file systems, or no hard links at all
+		if (!QFile::copy(file, target))
+		{
+			QLOG_ERROR() << "Can't put" << file << "into" << target_dir;
+			return false;
+		}
+		// the copy is the instance's own
+		QFile::setPermissions(target, writable);
+	}
+	return true;
+}
+
+void recordUse(QString instance_id, QStringList folders)
+{
+	QJsonArray keys;
+	for (auto folder : folders)
+		keys.append(QFileInfo(folder).fileName());
+	auto index = loadIndex();
+	if (index.value(instance_id).toArray() == keys)
+		return;
+	index.insert(instance_id, keys);
+	saveIndex(index);
+}
+
+void collectGarbage(QStringList instance_ids)
+{
+	QDir root("natives");
+	if (!root.exists())
+		return;
+	auto index = loadIndex();
+	QJsonObject kept_index;
+	QSet<QString> used;
+	for (auto id : instance_ids)
+	{
+		if (!index.contains(id))
+			continue;
+		auto keys = index.value(id).toArray();
+		kept_index.insert(id, keys);
+		for (auto key : keys)
+			used.insert(key.toString());
+	}
+	if (kept_index != index)
+		saveIndex(kept_index);
+
+	// the folders are named after 40 hex digits of SHA-1. leave everything else alone
+	QRegExp key_format("[0-9a-f]{40}");
+	for (auto key : root.entryList(QDir::Dirs | QDir::NoDotAndDotDot))
+	{
+		if (!key_format.exactMatch(key) || used.contains(key))
+			continue;
+		QString folder = root.absoluteFilePath(key);
+		QLOG_INFO() << "Removing unused native libraries" << folder;
+		setPermissions(folder, writable);
+		QDir(folder).removeRecursively();
+	}
+}
+}
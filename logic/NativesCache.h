@@ -0,0 +1,52 @@
+/* Copyright 2013 MultiMC Contributors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <QString>
+#include <QStringList>
+
+/*
+ * Native libraries, extracted once and shared by all instances.
+ *
+ * Every native jar is extracted into its own folder under 'natives/', named after the
+ * library, its MD5 and the extraction excludes. A launch only links the files from there
+ * into the instance's natives folder, instead of unzipping everything again. The cached files
+ * are read-only, because the links share them with every instance.
+ *
+ * 'natives/index.json' remembers which folders each instance used last, so the ones nobody
+ * uses anymore can be removed.
+ */
+namespace NativesCache
+{
+/**
+ * Get the folder with the contents of the native library jar at 'jar_path', extracting it
+ * first if that wasn't done before. 'storage' is the library's storage path and 'md5' the
+ * MD5 of the jar, if known. Returns an empty string on failure.
+ */
+QString extracted(QString storage, QString jar_path, QString md5, QStringList excludes);
+
+/**
+ * Put everything from 'source_dir' into 'target_dir', overwriting what's there.
+ * Files are hard linked where possible, and copied where not.
+ */
+bool linkInto(QString source_dir, QString target_dir);
+
+/// remember that the instance 'instance_id' uses the folders 'folders' (from extracted())
+void recordUse(QString instance_id, QStringList folders);
+
+/// remove the folders not used by any of the instances 'instance_ids', and forget the others
+void collectGarbage(QStringList instance_ids);
+}
@@ -20,10 +20,54 @@
 #include "net/NetJob.h"
 #include "net/HttpMetaCache.h"
 #include "net/S3ListBucket.h"
+#include "net/URLConstants.h"
 #include "MultiMC.h"
+#include <settingsobject.h>
 
-#define ASSETS_URL "http://resources.download.minecraft.net/"
+#define ASSETS_MANIFEST "assets_manifest.txt"
 
+// the assets that may be in the assets folder, according to the last sync
+static QSet<QString> loadManifest(bool *exists = nullptr)
+{
+	QSet<QString> manifest;
+	QFile file(ASSETS_MANIFEST);
+	if (exists)
+		*exists = file.exists();
+	if (!file.open(QIODevice::ReadOnly))
+		return manifest;
+	for (auto line : file.readAll().split('\n'))
+	{
+		if (!line.isEmpty())
+			manifest.insert(QString::fromUtf8(line));
+	}
+	return manifest;
+}
+
+static bool saveManifest(const QSet<QString> &manifest)
+{
+	QByteArray data;
+	for (auto key : manifest)
+	{
+		data.append(key.toUtf8());
+		data.append('\n');
+	}
+	QFile file(ASSETS_MANIFEST);
+	if (!file.open(QIODevice::WriteOnly))
+	{
+		QLOG_ERROR() << "Failed to write the assets manifest";
+		return false;
+	}
+	return file.write(data) == data.size();
+}
+
+/*
+ * Removes the assets that are no longer in the bucket.
+ *
+ * With a manifest from the last sync, only the assets that dropped out of the bucket since
+ * then are looked at. Without one, the whole folder is walked. Either way, the new whitelist
+ * becomes the manifest afterwards.
+ * In dry run mode nothing is deleted or saved, the victims are only reported in the log.
+ */
 class ThreadedDeleter : public QThread
 {
 	Q_OBJECT
@@ -31,32 +75,83 @@ public:
 	void run()
 	{
 		QLOG_INFO() << "Cleaning up assets folder...";
-		QDirIterator iter(m_base, QDirIterator::Subdirectories);
-		int base_length = m_base.length();
-		while (iter.hasNext())
+		if (m_whitelist.isEmpty())
+		{
+			// an empty bucket is much more likely to be a broken listing
+			QLOG_WARN() << "Empty assets whitelist, not cleaning up anything.";
+			return;
+		}
+		m_deleted = 0;
+		m_deleted_bytes = 0;
+		bool have_manifest = false;
+		QSet<QString> manifest = loadManifest(&have_manifest);
+		if (have_manifest)
 		{
-			QString filename = iter.next();
-			QFileInfo current(filename);
-			// we keep the dirs... whatever
-			if (current.isDir())
-				continue;
-			QString trimmedf = filename;
-			trimmedf.remove(0, base_length + 1);
-			if (m_whitelist.contains(trimmedf))
+			for (auto key : manifest)
 			{
-				QLOG_TRACE() << trimmedf << " gets to live";
+				if (!m_whitelist.contains(key))
+					kill(m_base + "/" + key, key);
 			}
-			else
+		}
+		else
+		{
+			QDirIterator iter(m_base, QDirIterator::Subdirectories);
+			int base_length = m_base.length();
+			while (iter.hasNext())
 			{
-				// DO NOT TOLERATE JUNK
-				QLOG_TRACE() << trimmedf << " dies";
-				QFile f(filename);
-				f.remove();
+				QString filename = iter.next();
+				QFileInfo current(filename);
+				// we keep the dirs... whatever
+				if (current.isDir())
+					continue;
+				QString trimmedf = filename;
+				trimmedf.remove(0, base_length + 1);
+				if (m_whitelist.contains(trimmedf))
+				{
+					QLOG_TRACE() << trimmedf << " gets to live";
+				}
+				else
+				{
+					kill(filename, trimmedf);
+				}
 			}
 		}
+		if (m_dry_run)
+		{
+			QLOG_INFO() << "Assets cleanup (dry run):" << m_deleted << "files," << m_deleted_bytes
+						<< "bytes would be deleted";
+			return;
+		}
+		QLOG_INFO() << "Assets cleanup:" << m_deleted << "files," << m_deleted_bytes
+					<< "bytes deleted";
+		saveManifest(m_whitelist);
+	}
+
+private:
+	void kill(QString filename, QString key)
+	{
+		QFileInfo info(filename);
+		if (!info.exists() || info.isDir())
+			return;
+		m_deleted++;
+		m_deleted_bytes += info.size();
+		if (m_dry_run)
+		{
+			QLOG_INFO() << key << " would die";
+			return;
+		}
+		// DO NOT TOLERATE JUNK
+		QLOG_TRACE() << key << " dies";
+		QFile f(filename);
+		f.remove();
 	}
+
+public:
 	QString m_base;
-	QStringList m_whitelist;
+	QSet<QString> m_whitelist;
+	bool m_dry_run = false;
+	int m_deleted = 0;
+	qint64 m_deleted_bytes = 0;
 };
 
 void OneSixAssets::downloadFinished()
@@ -65,13 +160,14 @@ void OneSixAssets::downloadFinished()
 	QDir dir("assets");
 	deleter->m_base = dir.absolutePath();
 	deleter->m_whitelist = nuke_whitelist;
+	deleter->m_dry_run = MMC->settings()->get("AssetsCleanupDryRun").toBool();
 	connect(deleter, SIGNAL(finished()), SIGNAL(finished()));
+	connect(deleter, SIGNAL(finished()), deleter, SLOT(deleteLater()));
 	deleter->start();
 }
 
 void OneSixAssets::S3BucketFinished()
 {
-	QString prefix(ASSETS_URL);
 	nuke_whitelist.clear();
 
 	emit filesStarted();
@@ -79,13 +175,9 @@ void OneSixAssets::S3BucketFinished()
 	auto firstJob = index_job->first();
 	auto objectList = std::dynamic_pointer_cast<S3ListBucket>(firstJob)->objects;
 
-	NetJob *job = new NetJob("Assets");
-
-	connect(job, SIGNAL(succeeded()), SLOT(downloadFinished()));
-	connect(job, SIGNAL(failed()), SIGNAL(failed()));
-	connect(job, SIGNAL(filesProgress(int, int, int)), SIGNAL(filesProgress(int, int, int)));
-
-	auto metacache = MMC->metacache();
+	// checking thousands of files takes a while. do it off the GUI thread.
+	validator.reset(new MetaCacheValidator("assets"));
+	connect(validator.get(), SIGNAL(finished()), SLOT(assetsValidated()));
 
 	for (auto object : objectList)
 	{
@@ -93,14 +185,38 @@ void OneSixAssets::S3BucketFinished()
 		if (object.size == 0)
 			continue;
 
-		nuke_whitelist.append(object.Key);
+		nuke_whitelist.insert(object.Key);
+		validator->addEntry(object.Key, object.ETag);
+	}
 
-		auto entry = metacache->resolveEntry("assets", object.Key, object.ETag);
-		if (entry->stale)
-		{
-			job->addNetAction(CacheDownload::make(QUrl(prefix + object.Key), entry));
-		}
+	// whatever gets downloaded now may be on disk even if we never get to clean up after it.
+	// keep the manifest a superset of the folder contents.
+	bool have_manifest = false;
+	auto manifest = loadManifest(&have_manifest);
+	if (have_manifest && !nuke_whitelist.isEmpty() && !manifest.contains(nuke_whitelist))
+	{
+		saveManifest(manifest.unite(nuke_whitelist));
 	}
+	validator->start();
+}
+
+void OneSixAssets::assetsValidated()
+{
+	QString prefix(URLConstants::ASSETS_BASE);
+
+	NetJob *job = new NetJob("Assets");
+	// nobody is waiting for these, so they shouldn't get in the way
+	job->setBackground(true);
+
+	connect(job, SIGNAL(succeeded()), SLOT(downloadFinished()));
+	connect(job, SIGNAL(failed()), SIGNAL(failed()));
+	connect(job, SIGNAL(filesProgress(int, int, int)), SIGNAL(filesProgress(int, int, int)));
+
+	for (auto entry : validator->staleEntries())
+	{
+		job->addNetAction(CacheDownload::make(QUrl(prefix + entry->path), entry));
+	}
+
 	if (job->size())
 	{
 		files_job.reset(job);
@@ -108,15 +224,17 @@ void OneSixAssets::S3BucketFinished()
 	}
 	else
 	{
+		// nothing to download, but assets may still have been dropped from the bucket
 		delete job;
-		emit finished();
+		downloadFinished();
 	}
 }
 
 void OneSixAssets::start()
 {
 	auto job = new NetJob("Assets index");
-	job->addNetAction(S3ListBucket::make(QUrl(ASSETS_URL)));
+	job->setBackground(true);
+	job->addNetAction(S3ListBucket::make(QUrl(URLConstants::ASSETS_BASE), "assets_listing.json"));
 	connect(job, SIGNAL(succeeded()), SLOT(S3BucketFinished()));
 	connect(job, SIGNAL(failed()), SIGNAL(failed()));
 	emit indexStarted();
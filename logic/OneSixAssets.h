@@ -15,6 +15,8 @@
 
 #pragma once
 #include "net/NetJob.h"
+#include "net/MetaCacheValidator.h"
+#include <QSet>
 
 class Private;
 class ThreadedDeleter;
@@ -32,6 +34,7 @@ signals:
 public
 slots:
 	void S3BucketFinished();
+	void assetsValidated();
 	void downloadFinished();
 
 public:
@@ -39,7 +42,8 @@ public:
 
 private:
 	ThreadedDeleter *deleter;
-	QStringList nuke_whitelist;
+	QSet<QString> nuke_whitelist;
 	NetJobPtr index_job;
 	NetJobPtr files_job;
+	MetaCacheValidatorPtr validator;
 };
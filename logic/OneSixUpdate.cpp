@@ -25,13 +25,16 @@
 
 #include "BaseInstance.h"
 #include "lists/MinecraftVersionList.h"
+#include "lists/InstanceList.h"
 #include "OneSixVersion.h"
 #include "OneSixLibrary.h"
 #include "OneSixInstance.h"
+#include "NativesCache.h"
 #include "net/ForgeMirrors.h"
+#include "net/CacheDownload.h"
+#include "net/URLConstants.h"
 
 #include "pathutils.h"
-#include <JlCompress.h>
 
 OneSixUpdate::OneSixUpdate(BaseInstance *inst, bool prepare_for_launch, QObject *parent)
 	: Task(parent), m_inst(inst), m_prepare_for_launch(prepare_for_launch)
@@ -73,13 +76,13 @@ void OneSixUpdate::checkJava()
 {
 	QLOG_INFO() << m_inst->name() << ": checking java binary";
 	setStatus("Testing the Java installation.");
-	// TODO: cache this so we don't have to run an extra java process every time.
 	QString java_path = m_inst->settings().get("JavaPath").toString();
 
 	checker.reset(new JavaChecker());
 	connect(checker.get(), SIGNAL(checkFinished(JavaCheckResult)), this,
 			SLOT(checkFinished(JavaCheckResult)));
-	checker->performCheck(java_path);
+	// only runs java if this binary wasn't checked before, or changed since
+	checker->performCachedCheck(java_path);
 }
 
 void OneSixUpdate::checkFinished(JavaCheckResult result)
@@ -103,10 +106,20 @@ void OneSixUpdate::versionFileStart()
 	QLOG_INFO() << m_inst->name() << ": getting version file.";
 	setStatus("Getting the version files from Mojang.");
 
-	QString urlstr("http://s3.amazonaws.com/Minecraft.Download/versions/");
-	urlstr += targetVersion->descriptor() + "/" + targetVersion->descriptor() + ".json";
+	QString descriptor = targetVersion->descriptor();
+	QString path = descriptor + "/" + descriptor + ".json";
+	QString urlstr = URLConstants::MOJANG_VERSIONS_BASE + path;
+
+	// the version files are shared by all instances, and always revalidated with the server
+	// (ETag / If-Modified-Since). when nothing changed, that's a cheap 304
+	auto entry = MMC->metacache()->resolveEntry("versions", path);
+	entry->stale = true;
 	auto job = new NetJob("Version index");
-	job->addNetAction(ByteArrayDownload::make(QUrl(urlstr)));
+	auto versionDownload = CacheDownload::make(QUrl(urlstr), entry);
+	versionDownload->m_accept_compressed = true;
+	job->addNetAction(versionDownload);
+	if (m_inst->settings().get("OverrideNetwork").toBool())
+		job->setBandwidthLimit(m_inst->settings().get("NetMaxBandwidth").toInt());
 	specificVersionDownloadJob.reset(job);
 	connect(specificVersionDownloadJob.get(), SIGNAL(succeeded()), SLOT(versionFileFinished()));
 	connect(specificVersionDownloadJob.get(), SIGNAL(failed()), SLOT(versionFileFailed()));
@@ -122,18 +135,27 @@ void OneSixUpdate::versionFileFinished()
 
 	QString version_id = targetVersion->descriptor();
 	QString inst_dir = m_inst->instanceRoot();
-	// save the version file in $instanceId/version.json
+	auto entry = std::dynamic_pointer_cast<CacheDownload>(DlJob)->m_entry;
+	// save the version file in $instanceId/version.json, unless it's already the same
+	QString version1 = PathCombine(inst_dir, "/version.json");
+	if (HttpMetaCache::fileMd5(version1) != entry->md5sum)
 	{
-		QString version1 = PathCombine(inst_dir, "/version.json");
+		QFile cached(entry->getFullPath());
+		if (!cached.open(QIODevice::ReadOnly))
+		{
+			emitFailed("Can't open " + entry->getFullPath() + " for reading.");
+			return;
+		}
+		auto data = cached.readAll();
+		cached.close();
+
 		ensureFilePathExists(version1);
-		// FIXME: detect errors here, download to a temp file, swap
 		QSaveFile vfile1(version1);
 		if (!vfile1.open(QIODevice::Truncate | QIODevice::WriteOnly))
 		{
 			emitFailed("Can't open " + version1 + " for writing.");
 			return;
 		}
-		auto data = std::dynamic_pointer_cast<ByteArrayDownload>(DlJob)->m_data;
 		qint64 actual = 0;
 		if ((actual = vfile1.write(data)) != data.size())
 		{
@@ -184,13 +206,15 @@ void OneSixUpdate::jarlibStart()
 	std::shared_ptr<OneSixVersion> version = inst->getFullVersion();
 
 	// download the right jar, save it in versions/$version/$version.jar
-	QString urlstr("http://s3.amazonaws.com/Minecraft.Download/versions/");
+	QString urlstr = URLConstants::MOJANG_VERSIONS_BASE;
 	urlstr += version->id + "/" + version->id + ".jar";
 	QString targetstr("versions/");
 	targetstr += version->id + "/" + version->id + ".jar";
 
 	auto job = new NetJob("Libraries for instance " + inst->name());
 	job->addNetAction(FileDownload::make(QUrl(urlstr), targetstr));
+	if (m_inst->settings().get("OverrideNetwork").toBool())
+		job->setBandwidthLimit(m_inst->settings().get("NetMaxBandwidth").toInt());
 	jarlibDownloadJob.reset(job);
 
 	auto libs = version->getActiveNativeLibs();
@@ -224,7 +248,7 @@ void OneSixUpdate::jarlibStart()
 		}
 	}
 	// TODO: think about how to propagate this from the original json file... or IF AT ALL
-	QString forgeMirrorList = "http://files.minecraftforge.net/mirror-brand.list";
+	QString forgeMirrorList = URLConstants::FORGE_MIRROR_LIST;
 	if (!ForgeLibs.empty())
 	{
 		jarlibDownloadJob->addNetAction(
@@ -285,17 +309,19 @@ void OneSixUpdate::prepareForLaunch()
 		return;
 	}
 
-	// Put swag in the bag
+	// Put swag in the bag. each library is only extracted once, into the shared natives cache
 	QString subst = java_is_64bit ? "64" : "32";
+	auto metacache = MMC->metacache();
+	QStringList used_folders;
 	for (auto lib : libs_to_extract)
 	{
 		QString storage = lib->storagePath();
 		storage.replace("${arch}", subst);
 
 		QString path = "libraries/" + storage;
-		QLOG_INFO() << "Will extract " << path.toLocal8Bit();
-		if (JlCompress::extractWithExceptions(path, natives_dir_raw, lib->extract_excludes)
-				.isEmpty())
+		QString md5 = metacache->resolveEntry("libraries", storage)->md5sum;
+		QString cached = NativesCache::extracted(storage, path, md5, lib->extract_excludes);
+		if (cached.isEmpty())
 		{
 			emitFailed(
 				"Could not extract the native library:\n" + path +
@@ -303,8 +329,25 @@ void OneSixUpdate::prepareForLaunch()
 				"on the storage device.");
 			return;
 		}
+		if (!NativesCache::linkInto(cached, natives_dir_raw))
+		{
+			emitFailed(
+				"Could not set up the native library:\n" + path +
+				"\nMake sure MultiMC has appropriate permissions and there is enough space "
+				"on the storage device.");
+			return;
+		}
+		used_folders.append(cached);
 	}
 
+	// whatever no instance uses anymore goes away
+	NativesCache::recordUse(m_inst->id(), used_folders);
+	QStringList instance_ids;
+	auto instances = MMC->instances();
+	for (int i = 0; i < instances->count(); i++)
+		instance_ids.append(instances->at(i)->id());
+	NativesCache::collectGarbage(instance_ids);
+
 	// Show them your war face!
 	emitSucceeded();
 }
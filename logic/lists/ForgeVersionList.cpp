@@ -15,6 +15,7 @@
 
 #include "ForgeVersionList.h"
 #include <logic/net/NetJob.h>
+#include <logic/net/URLConstants.h>
 #include "MultiMC.h"
 
 #include <QtNetwork>
@@ -23,7 +24,6 @@
 
 #include "logger/QsLog.h"
 
-#define JSON_URL "http://files.minecraftforge.net/minecraftforge/json"
 
 ForgeVersionList::ForgeVersionList(QObject *parent) : BaseVersionList(parent)
 {
@@ -166,7 +166,9 @@ void ForgeListLoadTask::executeTask()
 	// verify by poking the server.
 	forgeListEntry->stale = true;
 
-	job->addNetAction(CacheDownload::make(QUrl(JSON_URL), forgeListEntry));
+	auto listDownload = CacheDownload::make(QUrl(URLConstants::FORGE_JSON), forgeListEntry);
+	listDownload->m_accept_compressed = true;
+	job->addNetAction(listDownload);
 	listJob.reset(job);
 	connect(listJob.get(), SIGNAL(succeeded()), SLOT(list_downloaded()));
 	connect(listJob.get(), SIGNAL(failed()), SLOT(list_failed()));
@@ -22,6 +22,8 @@
 
 #include "logger/QsLog.h"
 #include <logic/JavaUtils.h>
+#include <QThread>
+#include <algorithm>
 
 JavaVersionList::JavaVersionList(QObject *parent) : BaseVersionList(parent)
 {
@@ -163,6 +165,26 @@ void JavaVersionList::updateListData(QList<BaseVersionPtr> versions)
 	// sort();
 }
 
+void JavaVersionList::clear()
+{
+	beginResetModel();
+	m_vlist.clear();
+	m_loaded = false;
+	endResetModel();
+}
+
+void JavaVersionList::addVersion(BaseVersionPtr version)
+{
+	beginInsertRows(QModelIndex(), m_vlist.size(), m_vlist.size());
+	m_vlist.append(version);
+	endInsertRows();
+}
+
+void JavaVersionList::setLoaded()
+{
+	m_loaded = true;
+}
+
 void JavaVersionList::sort()
 {
 	// NO-OP for now
@@ -183,20 +205,74 @@ void JavaListLoadTask::executeTask()
 	setStatus("Detecting Java installations...");
 
 	JavaUtils ju;
-	QList<JavaVersionPtr> javas = ju.FindJavaPaths();
+	m_candidates = ju.FindJavaPaths();
+	m_total = m_candidates.size();
+	m_done = 0;
+	m_working = 0;
+
+	// every check is a JVM starting up, so several of them run at the same time.
+	// the ones that work show up in the list as soon as they're done.
+	m_max_probes = std::max(2, QThread::idealThreadCount());
+	m_list->clear();
+	setStatus("Testing Java installations...");
+	startMoreProbes();
+}
 
-	QList<BaseVersionPtr> javas_bvp;
-	for (int i = 0; i < javas.length(); i++)
+void JavaListLoadTask::startMoreProbes()
+{
+	// a check can fail right away, which calls back into this. the outer call carries on.
+	if (m_scheduling)
+		return;
+	m_scheduling = true;
+	while (!m_candidates.isEmpty() && m_probes.size() < m_max_probes)
 	{
-		BaseVersionPtr java = std::dynamic_pointer_cast<BaseVersion>(javas.at(i));
-
-		if (java)
-		{
-			javas_bvp.append(java);
-		}
+		auto java = m_candidates.takeFirst();
+		auto checker = new JavaChecker(this);
+		m_probes[checker] = java;
+		connect(checker, SIGNAL(checkFinished(JavaCheckResult)),
+				SLOT(probeFinished(JavaCheckResult)));
+		// javas that were checked before and didn't change don't have to run again
+		checker->performCachedCheck(java->path);
 	}
+	m_scheduling = false;
+	if (!m_probes.isEmpty())
+		return;
 
-	m_list->updateListData(javas_bvp);
-
+	if (!m_working)
+	{
+		// keep the old fallback, so there's always something to pick
+		QLOG_WARN() << "None of the Java installations work - defaulting to \"java\"";
+		JavaUtils ju;
+		m_list->addVersion(ju.GetDefaultJava());
+	}
+	m_list->setLoaded();
 	emitSucceeded();
 }
+
+void JavaListLoadTask::probeFinished(JavaCheckResult result)
+{
+	auto checker = qobject_cast<JavaChecker *>(sender());
+	auto iter = m_probes.find(checker);
+	if (iter == m_probes.end())
+		return;
+	auto java = *iter;
+	m_probes.erase(iter);
+	// it's still in the middle of emitting this
+	checker->deleteLater();
+
+	m_done++;
+	setProgress(m_total ? m_done * 100 / m_total : 100);
+	if (result.valid)
+	{
+		java->arch = result.mojangPlatform;
+		if (!result.javaVersion.isEmpty())
+			java->id = result.javaVersion;
+		m_list->addVersion(java);
+		m_working++;
+	}
+	else
+	{
+		QLOG_INFO() << "Java at" << java->path << "doesn't work, skipping it";
+	}
+	startMoreProbes();
+}
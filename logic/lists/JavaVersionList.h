@@ -17,9 +17,11 @@
 
 #include <QObject>
 #include <QAbstractListModel>
+#include <QHash>
 
 #include "BaseVersionList.h"
 #include "logic/tasks/Task.h"
+#include "logic/JavaChecker.h"
 
 class JavaListLoadTask;
 
@@ -69,6 +71,12 @@ public:
 public
 slots:
 	virtual void updateListData(QList<BaseVersionPtr> versions);
+	/// empty the list for a new search. it isn't loaded until setLoaded()
+	void clear();
+	/// add a version to the list, as soon as it's known to work
+	void addVersion(BaseVersionPtr version);
+	/// all versions were added
+	void setLoaded();
 
 protected:
 	QList<BaseVersionPtr> m_vlist;
@@ -86,7 +94,26 @@ public:
 
 	virtual void executeTask();
 
+private
+slots:
+	void probeFinished(JavaCheckResult result);
+
+private:
+	/// keep up to m_max_probes java checks running
+	void startMoreProbes();
+
 protected:
 	JavaVersionList *m_list;
 	JavaVersion *m_currentRecommended;
+
+private:
+	/// found, but not checked yet
+	QList<JavaVersionPtr> m_candidates;
+	/// the checks in progress, and what they're checking
+	QHash<JavaChecker *, JavaVersionPtr> m_probes;
+	int m_max_probes = 2;
+	int m_total = 0;
+	int m_done = 0;
+	int m_working = 0;
+	bool m_scheduling = false;
 };
@@ -28,12 +28,36 @@
 
 #include <QtNetwork>
 
-#define MCVLIST_URLBASE "http://s3.amazonaws.com/Minecraft.Download/versions/"
+#include "logic/net/URLConstants.h"
+#include "logic/net/CacheDownload.h"
+
 #define ASSETS_URLBASE "http://assets.minecraft.net/"
 #define MCN_URLBASE "http://sonicrules.org/mcnweb.py"
 
 MinecraftVersionList::MinecraftVersionList(QObject *parent) : BaseVersionList(parent)
 {
+	legacyWhitelist.insert("1.5.2");
+	legacyWhitelist.insert("1.5.1");
+	legacyWhitelist.insert("1.5");
+	legacyWhitelist.insert("1.4.7");
+	legacyWhitelist.insert("1.4.6");
+	legacyWhitelist.insert("1.4.5");
+	legacyWhitelist.insert("1.4.4");
+	legacyWhitelist.insert("1.4.3");
+	legacyWhitelist.insert("1.4.2");
+	legacyWhitelist.insert("1.4.1");
+	legacyWhitelist.insert("1.4");
+	legacyWhitelist.insert("1.3.2");
+	legacyWhitelist.insert("1.3.1");
+	legacyWhitelist.insert("1.3");
+	legacyWhitelist.insert("1.2.5");
+	legacyWhitelist.insert("1.2.4");
+	legacyWhitelist.insert("1.2.3");
+	legacyWhitelist.insert("1.2.2");
+	legacyWhitelist.insert("1.2.1");
+	legacyWhitelist.insert("1.1");
+	legacyWhitelist.insert("1.0.1");
+	legacyWhitelist.insert("1.0");
 }
 
 Task *MinecraftVersionList::getLoadTask()
@@ -88,6 +112,8 @@ void MinecraftVersionList::updateListData(QList<BaseVersionPtr> versions)
 	beginResetModel();
 	m_vlist = versions;
 	m_loaded = true;
+	// fresh from the network. the cached copy is older than that
+	m_cache_checked = true;
 	endResetModel();
 	// NOW SORT!!
 	sort();
@@ -110,67 +136,49 @@ inline QDateTime timeFromS3Time(QString str)
 MCVListLoadTask::MCVListLoadTask(MinecraftVersionList *vlist)
 {
 	m_list = vlist;
-	m_currentStable = NULL;
-	vlistReply = nullptr;
-	legacyWhitelist.insert("1.5.2");
-	legacyWhitelist.insert("1.5.1");
-	legacyWhitelist.insert("1.5");
-	legacyWhitelist.insert("1.4.7");
-	legacyWhitelist.insert("1.4.6");
-	legacyWhitelist.insert("1.4.5");
-	legacyWhitelist.insert("1.4.4");
-	legacyWhitelist.insert("1.4.3");
-	legacyWhitelist.insert("1.4.2");
-	legacyWhitelist.insert("1.4.1");
-	legacyWhitelist.insert("1.4");
-	legacyWhitelist.insert("1.3.2");
-	legacyWhitelist.insert("1.3.1");
-	legacyWhitelist.insert("1.3");
-	legacyWhitelist.insert("1.2.5");
-	legacyWhitelist.insert("1.2.4");
-	legacyWhitelist.insert("1.2.3");
-	legacyWhitelist.insert("1.2.2");
-	legacyWhitelist.insert("1.2.1");
-	legacyWhitelist.insert("1.1");
-	legacyWhitelist.insert("1.0.1");
-	legacyWhitelist.insert("1.0");
 }
 
 MCVListLoadTask::~MCVListLoadTask()
 {
 }
 
-void MCVListLoadTask::executeTask()
+void MinecraftVersionList::loadCachedList()
 {
-	setStatus("Loading instance version list...");
-	auto worker = MMC->qnam();
-	vlistReply = worker->get(QNetworkRequest(QUrl(QString(MCVLIST_URLBASE) + "versions.json")));
-	connect(vlistReply, SIGNAL(finished()), this, SLOT(list_downloaded()));
-}
+	if (m_cache_checked || !MMC->metacache())
+		return;
+	m_cache_checked = true;
+	auto entry = MMC->metacache()->resolveEntry("versions", "versions.json");
+	QFile cached(entry->getFullPath());
+	if (!cached.open(QIODevice::ReadOnly))
+		return;
 
-void MCVListLoadTask::list_downloaded()
-{
-	if (vlistReply->error() != QNetworkReply::NoError)
+	QList<BaseVersionPtr> versions;
+	QString error;
+	if (!parseList(cached.readAll(), versions, error))
 	{
-		vlistReply->deleteLater();
-		emitFailed("Failed to load Minecraft main version list" + vlistReply->errorString());
+		QLOG_WARN() << "Ignoring the cached Minecraft version list:" << error;
 		return;
 	}
+	QLOG_INFO() << "Loaded" << versions.size() << "Minecraft versions from the cache";
+	updateListData(versions);
+}
 
+bool MinecraftVersionList::parseList(const QByteArray &data, QList<BaseVersionPtr> &out,
+									 QString &error) const
+{
 	QJsonParseError jsonError;
-	QJsonDocument jsonDoc = QJsonDocument::fromJson(vlistReply->readAll(), &jsonError);
-	vlistReply->deleteLater();
+	QJsonDocument jsonDoc = QJsonDocument::fromJson(data, &jsonError);
 
 	if (jsonError.error != QJsonParseError::NoError)
 	{
-		emitFailed("Error parsing version list JSON:" + jsonError.errorString());
-		return;
+		error = "Error parsing version list JSON:" + jsonError.errorString();
+		return false;
 	}
 
 	if (!jsonDoc.isObject())
 	{
-		emitFailed("Error parsing version list JSON: jsonDoc is not an object");
-		return;
+		error = "Error parsing version list JSON: jsonDoc is not an object";
+		return false;
 	}
 
 	QJsonObject root = jsonDoc.object();
@@ -178,8 +186,8 @@ void MCVListLoadTask::list_downloaded()
 	// Get the ID of the latest release and the latest snapshot.
 	if (!root.value("latest").isObject())
 	{
-		emitFailed("Error parsing version list JSON: version list is missing 'latest' object");
-		return;
+		error = "Error parsing version list JSON: version list is missing 'latest' object";
+		return false;
 	}
 
 	QJsonObject latest = root.value("latest").toObject();
@@ -188,21 +196,20 @@ void MCVListLoadTask::list_downloaded()
 	QString latestSnapshotID = latest.value("snapshot").toString("");
 	if (latestReleaseID.isEmpty())
 	{
-		emitFailed("Error parsing version list JSON: latest release field is missing");
-		return;
+		error = "Error parsing version list JSON: latest release field is missing";
+		return false;
 	}
 	if (latestSnapshotID.isEmpty())
 	{
-		emitFailed("Error parsing version list JSON: latest snapshot field is missing");
-		return;
+		error = "Error parsing version list JSON: latest snapshot field is missing";
+		return false;
 	}
 
 	// Now, get the array of versions.
 	if (!root.value("versions").isArray())
 	{
-		emitFailed(
-			"Error parsing version list JSON: version list object is missing 'versions' array");
-		return;
+		error = "Error parsing version list JSON: version list object is missing 'versions' array";
+		return false;
 	}
 	QJsonArray versions = root.value("versions").toArray();
 
@@ -270,7 +277,7 @@ void MCVListLoadTask::list_downloaded()
 			continue;
 		}
 		// Get the download URL.
-		QString dlUrl = QString(MCVLIST_URLBASE) + versionID + "/";
+		QString dlUrl = URLConstants::MOJANG_VERSIONS_BASE + versionID + "/";
 
 		// Now, we construct the version object and add it to the list.
 		std::shared_ptr<MinecraftVersion> mcVersion(new MinecraftVersion());
@@ -282,8 +289,68 @@ void MCVListLoadTask::list_downloaded()
 		mcVersion->type = versionType;
 		tempList.append(mcVersion);
 	}
-	m_list->updateListData(tempList);
+	out = tempList;
+	return true;
+}
+
+void MCVListLoadTask::executeTask()
+{
+	setStatus("Loading instance version list...");
+	// what's cached now is the old list. read it before the download replaces it
+	m_list->loadCachedList();
+	m_entry = MMC->metacache()->resolveEntry("versions", "versions.json");
+	m_old_md5 = m_entry->stale ? QString() : m_entry->md5sum;
+	// always ask the server. if nothing changed, we only pay for a 304
+	m_entry->stale = true;
+
+	auto job = new NetJob("Version list");
+	auto listDownload =
+		CacheDownload::make(QUrl(URLConstants::MOJANG_VERSIONS_BASE + "versions.json"), m_entry);
+	listDownload->m_accept_compressed = true;
+	job->addNetAction(listDownload);
+	vlistJob.reset(job);
+	connect(vlistJob.get(), SIGNAL(succeeded()), SLOT(list_downloaded()));
+	connect(vlistJob.get(), SIGNAL(failed()), SLOT(list_failed()));
+	vlistJob->start();
+}
+
+void MCVListLoadTask::list_failed()
+{
+	// the job is still emitting. it goes away with the task, or with the next load
+	if (m_list->isLoaded())
+	{
+		// offline or the server is having a bad day. the cached list will do
+		QLOG_WARN() << "Failed to refresh the Minecraft version list, keeping the cached one";
+		emitSucceeded();
+		return;
+	}
+	emitFailed("Failed to load Minecraft main version list");
+}
 
+void MCVListLoadTask::list_downloaded()
+{
+	// the job is still emitting. it goes away with the task, or with the next load
+	if (m_list->isLoaded() && !m_old_md5.isEmpty() && m_entry->md5sum == m_old_md5)
+	{
+		QLOG_INFO() << "Minecraft version list is up to date";
+		emitSucceeded();
+		return;
+	}
+
+	QFile listFile(m_entry->getFullPath());
+	if (!listFile.open(QIODevice::ReadOnly))
+	{
+		emitFailed("Can't open " + m_entry->getFullPath() + " for reading.");
+		return;
+	}
+
+	QList<BaseVersionPtr> versions;
+	QString error;
+	if (!m_list->parseList(listFile.readAll(), versions, error))
+	{
+		emitFailed(error);
+		return;
+	}
+	m_list->updateListData(versions);
 	emitSucceeded();
-	return;
 }
@@ -22,9 +22,10 @@
 #include "BaseVersionList.h"
 #include "logic/tasks/Task.h"
 #include "logic/MinecraftVersion.h"
+#include "logic/net/NetJob.h"
+#include "logic/net/HttpMetaCache.h"
 
 class MCVListLoadTask;
-class QNetworkReply;
 
 class MinecraftVersionList : public BaseVersionList
 {
@@ -42,10 +43,21 @@ public:
 
 	virtual BaseVersionPtr getLatestStable() const;
 
+	/// fill the list from the last downloaded versions.json, if there is one.
+	/// needs the metacache, and only does anything the first time
+	void loadCachedList();
+
+protected:
+	/// parse the contents of versions.json. returns false and sets 'error' if it's broken
+	bool parseList(const QByteArray &data, QList<BaseVersionPtr> &out, QString &error) const;
+
 protected:
 	QList<BaseVersionPtr> m_vlist;
+	QSet<QString> legacyWhitelist;
 
 	bool m_loaded = false;
+	/// the cached list was looked at, or replaced by a fresh one
+	bool m_cache_checked = false;
 
 protected
 slots:
@@ -65,10 +77,12 @@ public:
 protected
 slots:
 	void list_downloaded();
+	void list_failed();
 
 protected:
-	QNetworkReply *vlistReply;
+	NetJobPtr vlistJob;
+	MetaEntryPtr m_entry;
+	/// md5 of the cached versions.json before the refresh. empty if there was none
+	QString m_old_md5;
 	MinecraftVersionList *m_list;
-	MinecraftVersion *m_currentStable;
-	QSet<QString> legacyWhitelist;
 };
@@ -0,0 +1,138 @@
+/* Copyright 2013 MultiMC Contributors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "BandwidthLimiter.h"
+#include "MultiMC.h"
+
+#include <settingsobject.h>
+#include <algorithm>
+
+// the bucket holds a quarter second worth of data, but never less than this
+const qint64 min_burst = 16 * 1024;
+// what background downloads get while something in the foreground is downloading
+const qint64 background_trickle = 16 * 1024;
+// how long after the last foreground read background downloads stay slowed down
+const qint64 foreground_linger = 2000;
+
+// the configured background rate. the bucket's rate drops to the trickle while it yields
+static qint64 s_background_rate = 0;
+static QElapsedTimer s_last_foreground;
+
+BandwidthLimiter::BandwidthLimiter(qint64 bytes_per_second)
+{
+	setRate(bytes_per_second);
+}
+
+void BandwidthLimiter::setRate(qint64 bytes_per_second)
+{
+	bytes_per_second = std::max<qint64>(bytes_per_second, 0);
+	if (bytes_per_second == m_rate)
+		return;
+	refill();
+	m_rate = bytes_per_second;
+	if (!m_clock.isValid())
+	{
+		// start with a full bucket
+		m_clock.start();
+		m_tokens = std::max(m_rate / 4, min_burst);
+	}
+	m_tokens = std::min<double>(m_tokens, std::max(m_rate / 4, min_burst));
+}
+
+void BandwidthLimiter::refill()
+{
+	if (!m_clock.isValid())
+		return;
+	qint64 elapsed = m_clock.restart();
+	double burst = std::max(m_rate / 4, min_burst);
+	m_tokens = std::min(burst, m_tokens + double(m_rate) * elapsed / 1000.0);
+}
+
+qint64 BandwidthLimiter::available()
+{
+	if (!isLimited())
+		return -1;
+	refill();
+	return std::max<qint64>(qint64(m_tokens), 0);
+}
+
+void BandwidthLimiter::consume(qint64 bytes)
+{
+	if (!isLimited())
+		return;
+	m_tokens -= bytes;
+}
+
+BandwidthLimiter &BandwidthLimiter::global()
+{
+	static BandwidthLimiter limiter;
+	return limiter;
+}
+
+BandwidthLimiter &BandwidthLimiter::background()
+{
+	static BandwidthLimiter limiter;
+	return limiter;
+}
+
+void BandwidthLimiter::applySettings()
+{
+	// the settings are in KiB/s
+	global().setRate(MMC->settings()->get("NetMaxBandwidth").toLongLong() * 1024);
+	s_background_rate = MMC->settings()->get("NetBackgroundMaxBandwidth").toLongLong() * 1024;
+}
+
+void BandwidthLimiter::noteForeground()
+{
+	s_last_foreground.start();
+}
+
+bool BandwidthLimiter::foregroundActive()
+{
+	return s_last_foreground.isValid() && !s_last_foreground.hasExpired(foreground_linger);
+}
+
+qint64 BandwidthLimiter::allowance(BandwidthLimiter *job, bool background)
+{
+	qint64 result = -1;
+	auto take = [&result](qint64 limit)
+	{
+		if (limit >= 0)
+			result = result < 0 ? limit : std::min(result, limit);
+	};
+	take(global().available());
+	if (job)
+		take(job->available());
+	if (background)
+	{
+		qint64 rate = s_background_rate;
+		if (foregroundActive())
+			rate = rate > 0 ? std::min(rate, background_trickle) : background_trickle;
+		BandwidthLimiter::background().setRate(rate);
+		take(BandwidthLimiter::background().available());
+	}
+	return result;
+}
+
+void BandwidthLimiter::charge(BandwidthLimiter *job, bool background, qint64 bytes)
+{
+	global().consume(bytes);
+	if (job)
+		job->consume(bytes);
+	if (background)
+		BandwidthLimiter::background().consume(bytes);
+	else
+		noteForeground();
+}
@@ -0,0 +1,74 @@
+/* Copyright 2013 MultiMC Contributors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <QElapsedTimer>
+#include <memory>
+
+typedef std::shared_ptr<class BandwidthLimiter> BandwidthLimiterPtr;
+
+/*
+ * A token bucket. Downloads take tokens for every byte they read from the network.
+ * When the bucket is empty, the data stays in the socket and TCP slows the server down.
+ *
+ * There is one global bucket for everything, one for background downloads, and
+ * NetJob can have its own. Only used from the thread the downloads live on.
+ */
+class BandwidthLimiter
+{
+public:
+	/// 'bytes_per_second' <= 0 means unlimited
+	explicit BandwidthLimiter(qint64 bytes_per_second = 0);
+
+	void setRate(qint64 bytes_per_second);
+	qint64 rate() const
+	{
+		return m_rate;
+	}
+	bool isLimited() const
+	{
+		return m_rate > 0;
+	}
+
+	/// how many bytes may be read right now. -1 if unlimited
+	qint64 available();
+	/// 'bytes' were read
+	void consume(qint64 bytes);
+
+	/// the cap on all downloads (NetMaxBandwidth)
+	static BandwidthLimiter &global();
+	/// the cap on background downloads (NetBackgroundMaxBandwidth)
+	static BandwidthLimiter &background();
+	/// read the limits from the settings
+	static void applySettings();
+
+	/// a foreground download got data. background downloads back off for a while
+	static void noteForeground();
+	static bool foregroundActive();
+
+	/// how much a download may read right now, taking all the buckets that apply. -1 if unlimited
+	static qint64 allowance(BandwidthLimiter *job, bool background);
+	/// take what a download read from all the buckets that apply
+	static void charge(BandwidthLimiter *job, bool background, qint64 bytes);
+
+private:
+	void refill();
+
+private:
+	qint64 m_rate = 0;
+	double m_tokens = 0;
+	QElapsedTimer m_clock;
+};
@@ -38,6 +38,7 @@ void ByteArrayDownload::start()
 	connect(rep, SIGNAL(error(QNetworkReply::NetworkError)),
 			SLOT(downloadError(QNetworkReply::NetworkError)));
 	connect(rep, SIGNAL(readyRead()), SLOT(downloadReadyRead()));
+	watchReply(rep);
 }
 
 void ByteArrayDownload::downloadProgress(qint64 bytesReceived, qint64 bytesTotal)
@@ -23,7 +23,7 @@
 #include "logger/QsLog.h"
 
 CacheDownload::CacheDownload(QUrl url, MetaEntryPtr entry)
-	: NetAction(), md5sum(QCryptographicHash::Md5)
+	: NetAction()
 {
 	m_url = url;
 	m_entry = entry;
@@ -38,13 +38,44 @@ void CacheDownload::start()
 		emit succeeded(index_within_job);
 		return;
 	}
-	m_output_file.setFileName(m_target_path);
+	m_status = Job_InProgress;
+	// another job may be getting the same file already
+	if (followRunningDownload("cache:" + m_entry->base + "/" + m_entry->path))
+		return;
+	m_reply_checked = false;
+	m_resume_offset = 0;
 	// if there already is a file and md5 checking is in effect and it can be opened
 	if (!ensureFilePathExists(m_target_path))
 	{
+		m_status = Job_Failed;
 		emit failed(index_within_job);
 		return;
 	}
+	QString part_path = m_target_path + ".part";
+	if (!m_output || m_output->fileName() != part_path)
+	{
+		m_output = FileSink::create(part_path);
+		connect(m_output.get(), SIGNAL(finished(bool)), SLOT(outputFinished(bool)));
+	}
+	// keep the data from a previous attempt, if the server can tell us it's still good.
+	// the last attempt only reported back after its data was on disk, so this is all of it.
+	// the validator is only kept on disk while nobody is working on the data.
+	if (m_part_validator.isEmpty())
+		m_part_validator = loadPartValidator(part_path);
+	savePartValidator(part_path, QByteArray());
+	QFileInfo part_info(part_path);
+	if (part_info.exists())
+	{
+		if (!m_part_validator.isEmpty() && part_info.size() > 0)
+		{
+			m_resume_offset = part_info.size();
+			m_output->open(m_resume_offset);
+		}
+		else
+		{
+			m_output->remove();
+		}
+	}
 	QLOG_INFO() << "Downloading " << m_url.toString();
 	QNetworkRequest request(m_url);
 	if (m_entry->remote_changed_timestamp.size())
@@ -52,6 +83,17 @@ void CacheDownload::start()
 							 m_entry->remote_changed_timestamp.toLatin1());
 	if (m_entry->etag.size())
 		request.setRawHeader(QString("If-None-Match").toLatin1(), m_entry->etag.toLatin1());
+	if (m_resume_offset)
+	{
+		QLOG_INFO() << "Resuming " << m_url.toString() << " at " << m_resume_offset;
+		request.setRawHeader("Range", QString("bytes=%1-").arg(m_resume_offset).toLatin1());
+		request.setRawHeader("If-Range", m_part_validator);
+	}
+	// a range of a compressed response is useless to us, so resumed downloads stay plain
+	else if (m_accept_compressed)
+	{
+		ContentDecoder::acceptCompressed(request);
+	}
 
 	request.setHeader(QNetworkRequest::UserAgentHeader, "MultiMC/5.0 (Cached)");
 
@@ -65,11 +107,26 @@ void CacheDownload::start()
 	connect(rep, SIGNAL(error(QNetworkReply::NetworkError)),
 			SLOT(downloadError(QNetworkReply::NetworkError)));
 	connect(rep, SIGNAL(readyRead()), SLOT(downloadReadyRead()));
+	watchReply(rep);
+	throttleReply(rep);
+}
+
+void CacheDownload::leaderFinished(bool success)
+{
+	if (success)
+	{
+		// the other download updated the cache, most likely with what we wanted
+		m_entry = MMC->metacache()->resolveEntry(m_entry->base, m_entry->path);
+		m_target_path = m_entry->getFullPath();
+	}
+	start();
 }
 
 void CacheDownload::downloadProgress(qint64 bytesReceived, qint64 bytesTotal)
 {
-	emit progress(index_within_job, bytesReceived, bytesTotal);
+	if (bytesTotal >= 0)
+		bytesTotal += m_resume_offset;
+	emit progress(index_within_job, m_resume_offset + bytesReceived, bytesTotal);
 }
 
 void CacheDownload::downloadError(QNetworkReply::NetworkError error)
@@ -80,71 +137,185 @@ void CacheDownload::downloadError(QNetworkReply::NetworkError error)
 }
 void CacheDownload::downloadFinished()
 {
+	// the bandwidth caps may still be holding back some of the data
+	if (finishLater(m_reply.get()))
+		return;
+	// a reply without a body never got to downloadReadyRead()
+	if (!m_reply_checked && m_status != Job_Failed)
+		checkReply();
+	int status = m_reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
 	// if the download succeeded
 	if (m_status != Job_Failed)
 	{
-
 		// nothing went wrong...
-		m_status = Job_Finished;
-		if (m_output_file.isOpen())
+		if (status != 304)
 		{
-			// save the data to the downloadable if we aren't saving to file
-			m_output_file.close();
-			m_entry->md5sum = md5sum.result().toHex().constData();
-		}
-		else
-		{
-			if (m_output_file.open(QIODevice::ReadOnly))
+			// an empty body is a new, empty file too
+			if (!m_output->isOpen())
+				m_output->open();
+			if (!m_decoder.isComplete())
 			{
-				m_entry->md5sum =
-					QCryptographicHash::hash(m_output_file.readAll(), QCryptographicHash::Md5)
-						.toHex()
-						.constData();
-				m_output_file.close();
+				QLOG_ERROR() << "Failed to finish" << m_output->fileName();
+				m_output->remove();
+				m_part_validator.clear();
+				m_status = Job_Failed;
+				m_reply.reset();
+				emit failed(index_within_job);
+				return;
 			}
+			// move the finished data in place of the old file. outputFinished() goes on
+			m_output->commit(m_target_path);
+			return;
 		}
-		QFileInfo output_file_info(m_target_path);
 
-		m_entry->etag = m_reply->rawHeader("ETag").constData();
-		if (m_reply->hasRawHeader("Last-Modified"))
+		// not modified. whatever we had lying around is garbage now
+		m_output->remove();
+		m_part_validator.clear();
+
+		QString md5sum = HttpMetaCache::fileMd5(m_target_path);
+		if (!md5sum.isEmpty())
+			m_entry->md5sum = md5sum;
+		finishEntry();
+		return;
+	}
+	// else the download failed
+	else
+	{
+		// keep the partial data for the next attempt, if it can be resumed at all
+		if (!m_output->isOpen() || m_part_validator.isEmpty() || status == 416)
 		{
-			m_entry->remote_changed_timestamp = m_reply->rawHeader("Last-Modified").constData();
+			m_output->remove();
+			m_part_validator.clear();
+			m_reply.reset();
+			emit failed(index_within_job);
+			return;
 		}
-		m_entry->local_changed_timestamp =
-			output_file_info.lastModified().toUTC().toMSecsSinceEpoch();
-		m_entry->stale = false;
-		MMC->metacache()->updateEntry(m_entry);
+		// outputFinished() reports the failure once the data is on disk
+		m_output->close();
+		return;
+	}
+}
 
+void CacheDownload::outputFinished(bool success)
+{
+	if (m_status == Job_Failed)
+	{
+		// the partial data didn't make it to the disk, so there is nothing to resume
+		if (!success)
+			m_part_validator.clear();
+		savePartValidator(m_output->fileName(), m_part_validator);
 		m_reply.reset();
-		emit succeeded(index_within_job);
+		emit failed(index_within_job);
 		return;
 	}
-	// else the download failed
-	else
+	m_part_validator.clear();
+	if (!success)
 	{
-		m_output_file.close();
-		m_output_file.remove();
+		QLOG_ERROR() << "Failed to finish" << m_output->fileName();
+		m_output->remove();
+		m_status = Job_Failed;
 		m_reply.reset();
 		emit failed(index_within_job);
 		return;
 	}
+	m_entry->md5sum = m_output->md5sum();
+	finishEntry();
+}
+
+void CacheDownload::finishEntry()
+{
+	QFileInfo output_file_info(m_target_path);
+
+	m_entry->etag = m_reply->rawHeader("ETag").constData();
+	if (m_reply->hasRawHeader("Last-Modified"))
+	{
+		m_entry->remote_changed_timestamp = m_reply->rawHeader("Last-Modified").constData();
+	}
+	m_entry->local_changed_timestamp =
+		output_file_info.lastModified().toUTC().toMSecsSinceEpoch();
+	m_entry->stale = false;
+	MMC->metacache()->updateEntry(m_entry);
+
+	m_status = Job_Finished;
+	m_reply.reset();
+	emit succeeded(index_within_job);
+}
+
+qint64 CacheDownload::checkReply()
+{
+	m_reply_checked = true;
+	int status = m_reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+	// not modified. there is no body, and the partial data is dealt with when it's finished
+	if (status == 304)
+		return -1;
+	// only a whole (200) or partial (206) body goes into the '.part' file. 0 means not HTTP.
+	// anything else is an error page, and what we already have stays as it is
+	if (status != 200 && status != 206 && status != 0)
+	{
+		QLOG_ERROR() << "Failed" << m_url.toString() << "with status" << status;
+		m_status = Job_Failed;
+		QMetaObject::invokeMethod(m_reply.get(), "abort", Qt::QueuedConnection);
+		return -1;
+	}
+	if (status != 206 && m_output->isOpen())
+	{
+		// the server ignored the range. start over.
+		QLOG_INFO() << "Can't resume " << m_url.toString() << ", restarting";
+		m_output->open();
+		m_resume_offset = 0;
+	}
+	if (status != 206)
+	{
+		if (m_reply->hasRawHeader("ETag"))
+			m_part_validator = m_reply->rawHeader("ETag");
+		else
+			m_part_validator = m_reply->rawHeader("Last-Modified");
+	}
+	if (!m_decoder.reset(m_reply->rawHeader("Content-Encoding")))
+	{
+		m_status = Job_Failed;
+		m_part_validator.clear();
+		QMetaObject::invokeMethod(m_reply.get(), "abort", Qt::QueuedConnection);
+		return -1;
+	}
+	// what we write is decoded, so it doesn't match a range of the response
+	if (m_decoder.isCompressed())
+	{
+		m_part_validator.clear();
+		return -1;
+	}
+	if (m_reply->header(QNetworkRequest::ContentLengthHeader).isValid())
+		return m_reply->header(QNetworkRequest::ContentLengthHeader).toLongLong();
+	return -1;
 }
 
 void CacheDownload::downloadReadyRead()
 {
-	if (!m_output_file.isOpen())
+	qint64 expected_length = -1;
+	if (!m_reply_checked)
+		expected_length = checkReply();
+	if (m_status == Job_Failed)
+		return;
+	if (!m_output->isOpen())
+		m_output->open();
+	if (m_output->hasFailed())
 	{
-		if (!m_output_file.open(QIODevice::WriteOnly))
-		{
-			/*
-			* Can't open the file... the job failed
-			*/
-			m_reply->abort();
-			emit failed(index_within_job);
-			return;
-		}
+		/*
+		* Can't write the file... the job failed
+		*/
+		m_status = Job_Failed;
+		QMetaObject::invokeMethod(m_reply.get(), "abort", Qt::QueuedConnection);
+		return;
+	}
+	if (expected_length > 0)
+		m_output->preallocate(m_resume_offset + expected_length);
+	QByteArray ba;
+	if (!m_decoder.decode(readThrottled(m_reply.get(), m_output.get()), ba))
+	{
+		m_status = Job_Failed;
+		m_part_validator.clear();
+		QMetaObject::invokeMethod(m_reply.get(), "abort", Qt::QueuedConnection);
+		return;
 	}
-	QByteArray ba = m_reply->readAll();
-	md5sum.addData(ba);
-	m_output_file.write(ba);
+	m_output->write(ba);
 }
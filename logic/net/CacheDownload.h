@@ -17,8 +17,8 @@
 
 #include "NetAction.h"
 #include "HttpMetaCache.h"
-#include <QFile>
-#include <qcryptographichash.h>
+#include "ContentDecoder.h"
+#include "FileSink.h"
 
 typedef std::shared_ptr<class CacheDownload> CacheDownloadPtr;
 class CacheDownload : public NetAction
@@ -28,10 +28,14 @@ public:
 	MetaEntryPtr m_entry;
 	/// if saving to file, use the one specified in this string
 	QString m_target_path;
-	/// this is the output file, if any
-	QFile m_output_file;
-	/// the hash-as-you-download
-	QCryptographicHash md5sum;
+	/// the output. data goes into a '.part' file next to the target, hashed as it's written
+	FileSinkPtr m_output;
+	/// how much of the '.part' file was kept from a previous attempt
+	qint64 m_resume_offset = 0;
+	/// ETag or Last-Modified of the partial body, used for If-Range. empty = can't resume
+	QByteArray m_part_validator;
+	/// ask for a compressed transfer. worth it for text, like JSON metadata
+	bool m_accept_compressed = false;
 
 public:
 	explicit CacheDownload(QUrl url, MetaEntryPtr entry);
@@ -46,8 +50,24 @@ slots:
 	virtual void downloadError(QNetworkReply::NetworkError error);
 	virtual void downloadFinished();
 	virtual void downloadReadyRead();
+	/// the output was committed or closed
+	void outputFinished(bool success);
+
+protected:
+	virtual void leaderFinished(bool success);
 
 public
 slots:
 	virtual void start();
+
+private:
+	/// look at the headers of a new reply. returns the length of the body, -1 if unknown
+	qint64 checkReply();
+	/// the new file is in place. update the cache entry and report success
+	void finishEntry();
+
+private:
+	bool m_reply_checked = false;
+	/// undoes the Content-Encoding. the cache always gets the plain file
+	ContentDecoder m_decoder;
 };
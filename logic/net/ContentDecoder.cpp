@@ -0,0 +1,144 @@
+/* Copyright 2013 MultiMC Contributors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ContentDecoder.h"
+
+#include <zlib.h>
+#include <cstring>
+#include "logger/QsLog.h"
+
+const int buffer_size = 16384;
+
+ContentDecoder::ContentDecoder()
+{
+}
+
+ContentDecoder::~ContentDecoder()
+{
+	end();
+}
+
+void ContentDecoder::acceptCompressed(QNetworkRequest &request)
+{
+	request.setRawHeader("Accept-Encoding", "gzip, deflate");
+}
+
+bool ContentDecoder::reset(QByteArray encoding)
+{
+	end();
+	m_stream_end = false;
+	m_raw_fallback = false;
+	m_got_output = false;
+	m_seen_input.clear();
+
+	encoding = encoding.trimmed().toLower();
+	if (encoding.isEmpty() || encoding == "identity")
+		return true;
+	if (encoding == "gzip" || encoding == "x-gzip")
+	{
+		// 32 = detect gzip or zlib headers
+		return init(MAX_WBITS + 32);
+	}
+	if (encoding == "deflate")
+	{
+		m_raw_fallback = true;
+		return init(MAX_WBITS + 32);
+	}
+	QLOG_ERROR() << "Unknown content encoding:" << encoding;
+	return false;
+}
+
+bool ContentDecoder::init(int window_bits)
+{
+	m_stream = new z_stream;
+	memset(m_stream, 0, sizeof(z_stream));
+	if (inflateInit2(m_stream, window_bits) != Z_OK)
+	{
+		delete m_stream;
+		m_stream = nullptr;
+		return false;
+	}
+	return true;
+}
+
+void ContentDecoder::end()
+{
+	if (!m_stream)
+		return;
+	inflateEnd(m_stream);
+	delete m_stream;
+	m_stream = nullptr;
+}
+
+bool ContentDecoder::decode(const QByteArray &in, QByteArray &out)
+{
+	if (!m_stream)
+	{
+		out.append(in);
+		return true;
+	}
+	// trailing garbage after the end of the stream is ignored
+	if (m_stream_end || in.isEmpty())
+		return true;
+
+	// until 'deflate' is known to be zlib wrapped, remember the input, to restart with
+	if (m_raw_fallback)
+		m_seen_input.append(in);
+
+	char buf[buffer_size];
+	m_stream->next_in = (Bytef *)in.constData();
+	m_stream->avail_in = in.size();
+	do
+	{
+		m_stream->next_out = (Bytef *)buf;
+		m_stream->avail_out = buffer_size;
+		int ret = inflate(m_stream, Z_NO_FLUSH);
+		if (ret == Z_DATA_ERROR && m_raw_fallback && !m_got_output)
+		{
+			// not zlib wrapped, so it has to be a raw deflate stream. start over.
+			end();
+			m_raw_fallback = false;
+			if (!init(-MAX_WBITS))
+				return false;
+			QByteArray seen = m_seen_input;
+			m_seen_input.clear();
+			return decode(seen, out);
+		}
+		if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR)
+		{
+			QLOG_ERROR() << "Failed to decode compressed response:"
+						 << (m_stream->msg ? m_stream->msg : "unknown error");
+			return false;
+		}
+		int produced = buffer_size - m_stream->avail_out;
+		if (produced)
+		{
+			m_got_output = true;
+			m_raw_fallback = false;
+			m_seen_input.clear();
+			out.append(buf, produced);
+		}
+		if (ret == Z_STREAM_END)
+		{
+			m_stream_end = true;
+			break;
+		}
+		// nothing more can be done until more data arrives
+		if (ret == Z_BUF_ERROR)
+			break;
+		// a full buffer means there may be more output pending
+	} while (m_stream->avail_in || m_stream->avail_out == 0);
+	return true;
+}
@@ -0,0 +1,74 @@
+/* Copyright 2013 MultiMC Contributors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <QByteArray>
+#include <QNetworkRequest>
+
+struct z_stream_s;
+
+/*
+ * Undoes gzip/deflate Content-Encoding as the data arrives.
+ *
+ * Qt only decompresses replies by itself when it picked the Accept-Encoding header, and
+ * then hides the size of what went over the wire. We ask for compression explicitly, so
+ * progress stays in wire bytes, and decode here.
+ */
+class ContentDecoder
+{
+public:
+	ContentDecoder();
+	~ContentDecoder();
+
+	/// ask for a compressed transfer of the response to 'request'
+	static void acceptCompressed(QNetworkRequest &request);
+
+	/**
+	 * Start decoding a response with the given Content-Encoding header.
+	 * Returns false if it's an encoding we don't know.
+	 */
+	bool reset(QByteArray encoding);
+
+	/// true if the response is compressed at all
+	bool isCompressed() const
+	{
+		return m_stream != nullptr;
+	}
+
+	/// decode the next piece of the response. returns false if the data is broken
+	bool decode(const QByteArray &in, QByteArray &out);
+
+	/// true if the response is done: always for plain ones, at the end of the stream otherwise
+	bool isComplete() const
+	{
+		return !m_stream || m_stream_end;
+	}
+
+private:
+	bool init(int window_bits);
+	void end();
+
+private:
+	z_stream_s *m_stream = nullptr;
+	bool m_stream_end = false;
+	/// 'deflate' may be zlib wrapped or raw, depending on the server. we try both
+	bool m_raw_fallback = false;
+	bool m_got_output = false;
+	QByteArray m_seen_input;
+
+	ContentDecoder(const ContentDecoder &) = delete;
+	ContentDecoder &operator=(const ContentDecoder &) = delete;
+};
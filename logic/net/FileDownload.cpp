@@ -17,6 +17,7 @@
 #include "FileDownload.h"
 #include <pathutils.h>
 #include <QCryptographicHash>
+#include <QFileInfo>
 #include "logger/QsLog.h"
 
 FileDownload::FileDownload(QUrl url, QString target_path) : NetAction()
@@ -29,21 +30,26 @@ FileDownload::FileDownload(QUrl url, QString target_path) : NetAction()
 
 void FileDownload::start()
 {
+	m_status = Job_InProgress;
+	// another job may be getting the same file already
+	if (followRunningDownload("file:" + QFileInfo(m_target_path).absoluteFilePath()))
+		return;
 	QString filename = m_target_path;
-	m_output_file.setFileName(filename);
+	QFile existing(filename);
 	// if there already is a file and md5 checking is in effect and it can be opened
-	if (m_output_file.exists() && m_output_file.open(QIODevice::ReadOnly))
+	if (existing.exists() && existing.open(QIODevice::ReadOnly))
 	{
 		// check the md5 against the expected one
 		QString hash =
-			QCryptographicHash::hash(m_output_file.readAll(), QCryptographicHash::Md5)
+			QCryptographicHash::hash(existing.readAll(), QCryptographicHash::Md5)
 				.toHex()
 				.constData();
-		m_output_file.close();
+		existing.close();
 		// skip this file if they match
 		if (m_check_md5 && hash == m_expected_md5)
 		{
 			QLOG_INFO() << "Skipping " << m_url.toString() << ": md5 match.";
+			m_status = Job_Finished;
 			emit succeeded(index_within_job);
 			return;
 		}
@@ -54,13 +60,49 @@ void FileDownload::start()
 	}
 	if (!ensureFilePathExists(filename))
 	{
+		m_status = Job_Failed;
 		emit failed(index_within_job);
 		return;
 	}
 
+	m_status = Job_InProgress;
+	m_reply_checked = false;
+	m_resume_offset = 0;
+	QString part_path = filename + ".part";
+	if (!m_output || m_output->fileName() != part_path)
+	{
+		m_output = FileSink::create(part_path);
+		connect(m_output.get(), SIGNAL(finished(bool)), SLOT(outputFinished(bool)));
+	}
+	// keep the data from a previous attempt, if the server can tell us it's still good.
+	// the last attempt only reported back after its data was on disk, so this is all of it.
+	// the validator is only kept on disk while nobody is working on the data.
+	if (m_part_validator.isEmpty())
+		m_part_validator = loadPartValidator(part_path);
+	savePartValidator(part_path, QByteArray());
+	QFileInfo part_info(part_path);
+	if (part_info.exists())
+	{
+		if (!m_part_validator.isEmpty() && part_info.size() > 0)
+		{
+			m_resume_offset = part_info.size();
+			m_output->open(m_resume_offset);
+		}
+		else
+		{
+			m_output->remove();
+		}
+	}
+
 	QLOG_INFO() << "Downloading " << m_url.toString();
 	QNetworkRequest request(m_url);
 	request.setRawHeader(QString("If-None-Match").toLatin1(), m_expected_md5.toLatin1());
+	if (m_resume_offset)
+	{
+		QLOG_INFO() << "Resuming " << m_url.toString() << " at " << m_resume_offset;
+		request.setRawHeader("Range", QString("bytes=%1-").arg(m_resume_offset).toLatin1());
+		request.setRawHeader("If-Range", m_part_validator);
+	}
 	request.setHeader(QNetworkRequest::UserAgentHeader, "MultiMC/5.0 (Uncached)");
 
 	auto worker = MMC->qnam();
@@ -73,11 +115,27 @@ void FileDownload::start()
 	connect(rep, SIGNAL(error(QNetworkReply::NetworkError)),
 			SLOT(downloadError(QNetworkReply::NetworkError)));
 	connect(rep, SIGNAL(readyRead()), SLOT(downloadReadyRead()));
+	watchReply(rep);
+	throttleReply(rep);
+}
+
+void FileDownload::leaderFinished(bool success)
+{
+	if (success)
+	{
+		// the file is there now
+		m_status = Job_Finished;
+		emit succeeded(index_within_job);
+		return;
+	}
+	start();
 }
 
 void FileDownload::downloadProgress(qint64 bytesReceived, qint64 bytesTotal)
 {
-	emit progress(index_within_job, bytesReceived, bytesTotal);
+	if (bytesTotal >= 0)
+		bytesTotal += m_resume_offset;
+	emit progress(index_within_job, m_resume_offset + bytesReceived, bytesTotal);
 }
 
 void FileDownload::downloadError(QNetworkReply::NetworkError error)
@@ -89,13 +147,31 @@ void FileDownload::downloadError(QNetworkReply::NetworkError error)
 
 void FileDownload::downloadFinished()
 {
+	// the bandwidth caps may still be holding back some of the data
+	if (finishLater(m_reply.get()))
+		return;
+	// a reply without a body never got to downloadReadyRead()
+	if (!m_reply_checked && m_status != Job_Failed)
+		checkReply();
+	int status = m_reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
 	// if the download succeeded
 	if (m_status != Job_Failed)
 	{
 		// nothing went wrong...
-		m_status = Job_Finished;
-		m_output_file.close();
+		if (status != 304)
+		{
+			// an empty body is a new, empty file too
+			if (!m_output->isOpen())
+				m_output->open();
+			// move the finished data in place of the old file. outputFinished() goes on
+			m_output->commit(m_target_path);
+			return;
+		}
+		// not modified. whatever we had lying around is garbage now
+		m_output->remove();
+		m_part_validator.clear();
 
+		m_status = Job_Finished;
 		m_reply.reset();
 		emit succeeded(index_within_job);
 		return;
@@ -103,26 +179,100 @@ void FileDownload::downloadFinished()
 	// else the download failed
 	else
 	{
-		m_output_file.close();
+		// keep the partial data for the next attempt, if it can be resumed at all
+		if (!m_output->isOpen() || m_part_validator.isEmpty() || status == 416)
+		{
+			m_output->remove();
+			m_part_validator.clear();
+			m_reply.reset();
+			emit failed(index_within_job);
+			return;
+		}
+		// outputFinished() reports the failure once the data is on disk
+		m_output->close();
+		return;
+	}
+}
+
+void FileDownload::outputFinished(bool success)
+{
+	if (m_status == Job_Failed)
+	{
+		// the partial data didn't make it to the disk, so there is nothing to resume
+		if (!success)
+			m_part_validator.clear();
+		savePartValidator(m_output->fileName(), m_part_validator);
 		m_reply.reset();
 		emit failed(index_within_job);
 		return;
 	}
+	m_part_validator.clear();
+	m_reply.reset();
+	if (!success)
+	{
+		m_output->remove();
+		m_status = Job_Failed;
+		emit failed(index_within_job);
+		return;
+	}
+	m_status = Job_Finished;
+	emit succeeded(index_within_job);
+}
+
+qint64 FileDownload::checkReply()
+{
+	m_reply_checked = true;
+	int status = m_reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+	// not modified. there is no body, and the partial data is dealt with when it's finished
+	if (status == 304)
+		return -1;
+	// only a whole (200) or partial (206) body goes into the '.part' file. 0 means not HTTP.
+	// anything else is an error page, and what we already have stays as it is
+	if (status != 200 && status != 206 && status != 0)
+	{
+		QLOG_ERROR() << "Failed" << m_url.toString() << "with status" << status;
+		m_status = Job_Failed;
+		QMetaObject::invokeMethod(m_reply.get(), "abort", Qt::QueuedConnection);
+		return -1;
+	}
+	if (status != 206 && m_output->isOpen())
+	{
+		// the server ignored the range. start over.
+		QLOG_INFO() << "Can't resume " << m_url.toString() << ", restarting";
+		m_output->open();
+		m_resume_offset = 0;
+	}
+	if (status != 206)
+	{
+		if (m_reply->hasRawHeader("ETag"))
+			m_part_validator = m_reply->rawHeader("ETag");
+		else
+			m_part_validator = m_reply->rawHeader("Last-Modified");
+	}
+	if (m_reply->header(QNetworkRequest::ContentLengthHeader).isValid())
+		return m_reply->header(QNetworkRequest::ContentLengthHeader).toLongLong();
+	return -1;
 }
 
 void FileDownload::downloadReadyRead()
 {
-	if (!m_output_file.isOpen())
+	qint64 expected_length = -1;
+	if (!m_reply_checked)
+		expected_length = checkReply();
+	if (m_status == Job_Failed)
+		return;
+	if (!m_output->isOpen())
+		m_output->open();
+	if (m_output->hasFailed())
 	{
-		if (!m_output_file.open(QIODevice::WriteOnly))
-		{
-			/*
-			* Can't open the file... the job failed
-			*/
-			m_reply->abort();
-			emit failed(index_within_job);
-			return;
-		}
+		/*
+		* Can't write the file... the job failed
+		*/
+		m_status = Job_Failed;
+		QMetaObject::invokeMethod(m_reply.get(), "abort", Qt::QueuedConnection);
+		return;
 	}
-	m_output_file.write(m_reply->readAll());
+	if (expected_length > 0)
+		m_output->preallocate(m_resume_offset + expected_length);
+	m_output->write(readThrottled(m_reply.get(), m_output.get()));
 }
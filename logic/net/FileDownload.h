@@ -16,7 +16,7 @@
 #pragma once
 
 #include "NetAction.h"
-#include <QFile>
+#include "FileSink.h"
 
 typedef std::shared_ptr<class FileDownload> FileDownloadPtr;
 class FileDownload : public NetAction
@@ -31,8 +31,12 @@ public:
 	QString m_expected_md5;
 	/// if saving to file, use the one specified in this string
 	QString m_target_path;
-	/// this is the output file, if any
-	QFile m_output_file;
+	/// the output. data goes into a '.part' file next to the target
+	FileSinkPtr m_output;
+	/// how much of the '.part' file was kept from a previous attempt
+	qint64 m_resume_offset = 0;
+	/// ETag or Last-Modified of the partial body, used for If-Range. empty = can't resume
+	QByteArray m_part_validator;
 
 public:
 	explicit FileDownload(QUrl url, QString target_path);
@@ -46,8 +50,20 @@ slots:
 	virtual void downloadError(QNetworkReply::NetworkError error);
 	virtual void downloadFinished();
 	virtual void downloadReadyRead();
+	/// the output was committed or closed
+	void outputFinished(bool success);
+
+protected:
+	virtual void leaderFinished(bool success);
 
 public
 slots:
 	virtual void start();
+
+private:
+	/// look at the headers of a new reply. returns the length of the body, -1 if unknown
+	qint64 checkReply();
+
+private:
+	bool m_reply_checked = false;
 };
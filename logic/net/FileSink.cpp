@@ -0,0 +1,405 @@
+/* Copyright 2013 MultiMC Contributors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "FileSink.h"
+#include "NetAction.h"
+
+#include <QRunnable>
+#include <QMutexLocker>
+#include <QFileInfo>
+#include <QSet>
+#include <algorithm>
+#include "logger/QsLog.h"
+
+#ifdef Q_OS_WIN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstdio>
+#endif
+
+// downloads stop reading while this much data is waiting for the disk
+const qint64 max_queued_bytes = 16 * 1024 * 1024;
+// data is collected until there is this much, then written in one go
+const int write_size = 256 * 1024;
+// ... in multiples of this, counted from the start of the file
+const qint64 write_alignment = 64 * 1024;
+
+// committed files that still need to be flushed to disk
+static QMutex s_unsynced_lock;
+static QStringList s_unsynced;
+
+class FileSyncRunner : public QRunnable
+{
+public:
+	FileSyncRunner(QStringList paths) : m_paths(paths)
+	{
+	}
+	virtual void run()
+	{
+		QSet<QString> dirs;
+		for (auto path : m_paths)
+		{
+			sync(path, false);
+			dirs.insert(QFileInfo(path).absolutePath());
+		}
+		// the renames live in the directories
+		for (auto dir : dirs)
+			sync(dir, true);
+	}
+
+private:
+	static void sync(QString path, bool directory)
+	{
+#ifdef Q_OS_WIN
+		// needs write access to the file, which another download may have by now. skip it.
+		Q_UNUSED(path);
+		Q_UNUSED(directory);
+#else
+		Q_UNUSED(directory);
+		int fd = ::open(QFile::encodeName(path).constData(), O_RDONLY);
+		if (fd < 0)
+			return;
+		fsync(fd);
+		::close(fd);
+#endif
+	}
+	QStringList m_paths;
+};
+
+class FileSinkRunner : public QRunnable
+{
+public:
+	FileSinkRunner(FileSinkPtr sink) : m_sink(sink)
+	{
+	}
+	virtual void run()
+	{
+		m_sink->work();
+	}
+
+private:
+	FileSinkPtr m_sink;
+};
+
+FileSinkPtr FileSink::create(QString path)
+{
+	return FileSinkPtr(new FileSink(path), [](FileSink *sink)
+	{
+		// runners hold references too, and they may let go last, on an I/O thread
+		sink->deleteLater();
+	});
+}
+
+FileSink::FileSink(QString path)
+	: QObject(0), m_path(path), m_file(path), m_md5(QCryptographicHash::Md5)
+{
+}
+
+FileSink::~FileSink()
+{
+	// runners hold a reference, so none can be active here
+	if (m_file.isOpen())
+		m_file.close();
+}
+
+void FileSink::enqueue(Operation::Kind kind, QByteArray data, qint64 keep, QString target)
+{
+	Operation op;
+	op.kind = kind;
+	op.data = data;
+	op.keep = keep;
+	op.target = target;
+	m_queue.append(op);
+	m_queued_bytes += data.size();
+	schedule();
+}
+
+void FileSink::open(qint64 keep)
+{
+	QMutexLocker locker(&m_lock);
+	// whatever was queued for the old contents is useless now
+	for (auto iter = m_queue.begin(); iter != m_queue.end();)
+	{
+		if ((*iter).kind == Operation::Data)
+		{
+			m_queued_bytes -= (*iter).data.size();
+			iter = m_queue.erase(iter);
+		}
+		else
+			iter++;
+	}
+	m_preallocate = 0;
+	m_failed = false;
+	m_pending_opens++;
+	m_open = true;
+	enqueue(Operation::Open, QByteArray(), keep);
+}
+
+void FileSink::preallocate(qint64 size)
+{
+	QMutexLocker locker(&m_lock);
+	if (!m_open || m_failed)
+		return;
+	m_preallocate = size;
+	schedule();
+}
+
+void FileSink::write(QByteArray data)
+{
+	if (data.isEmpty())
+		return;
+	QMutexLocker locker(&m_lock);
+	if (!m_open || m_failed)
+		return;
+	enqueue(Operation::Data, data);
+}
+
+bool FileSink::isBusy()
+{
+	QMutexLocker locker(&m_lock);
+	return m_queued_bytes > max_queued_bytes;
+}
+
+bool FileSink::hasFailed()
+{
+	QMutexLocker locker(&m_lock);
+	return m_failed;
+}
+
+void FileSink::close()
+{
+	QMutexLocker locker(&m_lock);
+	m_open = false;
+	enqueue(Operation::Close);
+}
+
+void FileSink::commit(QString target)
+{
+	QMutexLocker locker(&m_lock);
+	m_open = false;
+	enqueue(Operation::Commit, QByteArray(), 0, target);
+}
+
+void FileSink::remove()
+{
+	QMutexLocker locker(&m_lock);
+	m_queue.clear();
+	m_queued_bytes = 0;
+	m_preallocate = 0;
+	m_pending_opens = 0;
+	m_open = false;
+	enqueue(Operation::Remove);
+}
+
+bool FileSink::replaceFile(QString source, QString target)
+{
+#ifdef Q_OS_WIN
+	return MoveFileExW((LPCWSTR)source.utf16(), (LPCWSTR)target.utf16(),
+					   MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+	return ::rename(QFile::encodeName(source).constData(),
+					QFile::encodeName(target).constData()) == 0;
+#endif
+}
+
+void FileSink::syncLater(QString path)
+{
+	QMutexLocker locker(&s_unsynced_lock);
+	s_unsynced.append(path);
+}
+
+void FileSink::syncCommitted()
+{
+	QStringList paths;
+	{
+		QMutexLocker locker(&s_unsynced_lock);
+		paths.swap(s_unsynced);
+	}
+	if (paths.isEmpty())
+		return;
+	NetAction::ioPool()->start(new FileSyncRunner(paths));
+}
+
+void FileSink::schedule()
+{
+	if (m_running)
+		return;
+	m_running = true;
+	NetAction::ioPool()->start(new FileSinkRunner(shared_from_this()));
+}
+
+void FileSink::work()
+{
+	QMutexLocker locker(&m_lock);
+	while (true)
+	{
+		// the size can come in at any time. it's used as soon as the file is open
+		if (m_preallocate && !m_pending_opens && m_file.isOpen() && !m_broken)
+		{
+			qint64 size = m_preallocate;
+			m_preallocate = 0;
+			locker.unlock();
+			reserveSpace(size);
+			locker.relock();
+		}
+		if (m_queue.isEmpty())
+			break;
+		Operation op = m_queue.takeFirst();
+		if (op.kind == Operation::Open)
+			m_pending_opens--;
+		locker.unlock();
+		bool report = false, success = true;
+		switch (op.kind)
+		{
+		case Operation::Open:
+			m_broken = !openFile(op.keep);
+			break;
+		case Operation::Data:
+			if (m_broken)
+				break;
+			m_md5.addData(op.data);
+			m_buffer.append(op.data);
+			if (m_buffer.size() >= write_size && !flushBuffer(false))
+				m_broken = true;
+			break;
+		case Operation::Close:
+		case Operation::Commit:
+			success = closeFile(m_broken, op.target);
+			report = true;
+			break;
+		case Operation::Remove:
+			closeFile(true, QString());
+			break;
+		}
+		locker.relock();
+		m_queued_bytes -= op.data.size();
+		if (m_broken && !m_pending_opens)
+			m_failed = true;
+		if (report)
+		{
+			locker.unlock();
+			emit finished(success);
+			locker.relock();
+		}
+	}
+	m_running = false;
+}
+
+void FileSink::reserveSpace(qint64 size)
+{
+#if defined(Q_OS_LINUX)
+	// only reserve the blocks. the size of the file has to stay what was written, or a
+	// resumed download would take the reserved space for data
+	qint64 offset = m_file.pos() + m_buffer.size();
+	if (size > offset)
+		fallocate(m_file.handle(), FALLOC_FL_KEEP_SIZE, offset, size - offset);
+#else
+	Q_UNUSED(size);
+#endif
+}
+
+bool FileSink::openFile(qint64 keep)
+{
+	if (m_file.isOpen())
+		m_file.close();
+	m_md5.reset();
+	m_md5sum.clear();
+	m_buffer.clear();
+	// we do our own buffering, in bigger pieces
+	if (!keep)
+	{
+		if (!m_file.open(QIODevice::WriteOnly | QIODevice::Truncate | QIODevice::Unbuffered))
+		{
+			QLOG_ERROR() << "Failed to open" << m_path << ":" << m_file.errorString();
+			return false;
+		}
+		return true;
+	}
+	if (!m_file.open(QIODevice::ReadWrite | QIODevice::Unbuffered) || m_file.size() < keep ||
+		!m_file.resize(keep))
+	{
+		QLOG_ERROR() << "Failed to reopen" << m_path << ":" << m_file.errorString();
+		return false;
+	}
+	// the old data still goes into the hash
+	char buf[16384];
+	qint64 done = 0;
+	bool ok = m_file.seek(0);
+	while (ok && done < keep)
+	{
+		qint64 count = m_file.read(buf, std::min<qint64>(sizeof(buf), keep - done));
+		if (count <= 0)
+			ok = false;
+		else
+		{
+			m_md5.addData(buf, count);
+			done += count;
+		}
+	}
+	if (!ok || !m_file.seek(keep))
+	{
+		QLOG_ERROR() << "Failed to read back" << m_path;
+		return false;
+	}
+	return true;
+}
+
+bool FileSink::closeFile(bool failed, QString target)
+{
+	bool ok = !failed && m_file.isOpen() && flushBuffer(true);
+	if (m_file.isOpen())
+		m_file.close();
+	m_buffer.clear();
+	if (!ok)
+	{
+		m_file.remove();
+		return false;
+	}
+	m_md5sum = m_md5.result().toHex().constData();
+	if (target.isEmpty())
+		return true;
+	if (!replaceFile(m_path, target))
+	{
+		QLOG_ERROR() << "Failed to move" << m_path << "to" << target;
+		return false;
+	}
+	syncLater(target);
+	return true;
+}
+
+bool FileSink::flushBuffer(bool all)
+{
+	qint64 length = m_buffer.size();
+	if (!all)
+	{
+		// end the write on a block boundary, the rest waits for more data
+		qint64 end = (m_file.pos() + length) / write_alignment * write_alignment;
+		length = end - m_file.pos();
+		if (length <= 0)
+			return true;
+	}
+	if (length == 0)
+		return true;
+	if (m_file.write(m_buffer.constData(), length) != length)
+	{
+		QLOG_ERROR() << "Failed to write to" << m_path << ":" << m_file.errorString();
+		m_buffer.clear();
+		return false;
+	}
+	m_buffer.remove(0, length);
+	return true;
+}
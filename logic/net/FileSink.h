@@ -0,0 +1,159 @@
+/* Copyright 2013 MultiMC Contributors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <QObject>
+#include <QString>
+#include <QByteArray>
+#include <QList>
+#include <QFile>
+#include <QMutex>
+#include <QCryptographicHash>
+#include <memory>
+
+typedef std::shared_ptr<class FileSink> FileSinkPtr;
+
+/*
+ * The disk end of a download. Everything is done on NetAction::ioPool(), in the order it was
+ * asked for, so the thread that reads the network replies never waits for the disk. When the
+ * disk falls far behind, isBusy() tells the download to leave the data in the socket for a
+ * while.
+ *
+ * Data is collected into big aligned writes, and the space for the file is reserved up front
+ * when its size is known. Finished files are put in place with an atomic rename by commit(),
+ * and flushed to disk later, all at once, by syncCommitted().
+ *
+ * Only the thread that owns the download calls the public methods. Keep one sink per file,
+ * so nothing done to it can overtake what is still queued. Runners hold references, so
+ * always make one with create(), which has it deleted on the thread it lives on.
+ */
+class FileSink : public QObject, public std::enable_shared_from_this<FileSink>
+{
+	Q_OBJECT
+public:
+	static FileSinkPtr create(QString path);
+	virtual ~FileSink();
+
+	/**
+	 * Open the file, keeping (and hashing) its first 'keep' bytes. With 0, it starts out empty.
+	 * Calling this on an open file starts it over.
+	 */
+	void open(qint64 keep = 0);
+	bool isOpen() const
+	{
+		return m_open;
+	}
+	QString fileName() const
+	{
+		return m_path;
+	}
+
+	/// reserve space for a file of 'size' bytes, if the platform can do that
+	void preallocate(qint64 size);
+	/// queue data for writing
+	void write(QByteArray data);
+	/// true while so much data is waiting for the disk that the download should stop reading
+	bool isBusy();
+	/// true if something went wrong since the file was opened. nothing more gets written
+	bool hasFailed();
+
+	/**
+	 * Write out everything and close the file. finished() tells how it went.
+	 * If anything failed, the file is deleted, so nobody picks up broken data later.
+	 */
+	void close();
+	/// like close(), then put the file in place of 'target', atomically
+	void commit(QString target);
+	/// drop whatever is queued, close the file and delete it
+	void remove();
+
+	/// replace 'target' with 'source' in one step, where the platform allows it
+	static bool replaceFile(QString source, QString target);
+	/// remember to flush 'path' to disk with the next syncCommitted()
+	static void syncLater(QString path);
+	/// flush everything committed since the last call to disk, in the background
+	static void syncCommitted();
+
+	/// md5 of the whole file, valid after a successful finished()
+	QString md5sum() const
+	{
+		return m_md5sum;
+	}
+
+signals:
+	/**
+	 * A close() or commit() is done. Emitted from the worker, so connect with a queued
+	 * connection. Don't ask for another one before this arrives.
+	 */
+	void finished(bool success);
+
+private:
+	explicit FileSink(QString path);
+	friend class FileSinkRunner;
+
+	struct Operation
+	{
+		enum Kind
+		{
+			Open,
+			Data,
+			Close,
+			Commit,
+			Remove
+		} kind;
+		QByteArray data;
+		qint64 keep;
+		QString target;
+	};
+	/// queue an operation for the worker. call with the lock held
+	void enqueue(Operation::Kind kind, QByteArray data = QByteArray(), qint64 keep = 0,
+				 QString target = QString());
+	/// make sure a runner is working on the queue. call with the lock held
+	void schedule();
+	/// worker side: work through the queue
+	void work();
+	/// worker side: the parts of the queue
+	bool openFile(qint64 keep);
+	void reserveSpace(qint64 size);
+	bool closeFile(bool failed, QString target);
+	/// worker side: write out the buffered data. all of it, or only whole blocks
+	bool flushBuffer(bool all);
+
+private:
+	QString m_path;
+	/// what the owner asked for last
+	bool m_open = false;
+
+	/// shared with the worker, protected by m_lock
+	QMutex m_lock;
+	QList<Operation> m_queue;
+	qint64 m_queued_bytes = 0;
+	qint64 m_preallocate = 0;
+	/// open()s the worker hasn't got to yet. failures from before them don't count
+	int m_pending_opens = 0;
+	bool m_running = false;
+	bool m_failed = false;
+
+	/// worker only
+	QFile m_file;
+	/// something failed since the file was opened
+	bool m_broken = false;
+	QCryptographicHash m_md5;
+	QByteArray m_buffer;
+
+	/// written by the worker before finished()
+	QString m_md5sum;
+};
@@ -0,0 +1,197 @@
+/* Copyright 2013 MultiMC Contributors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ForgeMirrorStats.h"
+
+#include <QFile>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QJsonArray>
+#include <algorithm>
+#include "logger/QsLog.h"
+
+#define MIRROR_STATS_FORMAT_VERSION 1
+
+// weight of a new measurement in the smoothed averages
+const double smoothing = 0.3;
+// size of a 'typical' forge library, for comparing latency with throughput
+const double typical_size = 512 * 1024;
+// guesses for when we know nothing at all
+const double default_latency = 500;
+const double default_throughput = 100;
+// mirrors this much slower than the fastest one don't get any downloads by default
+const double spread_factor = 1.5;
+// ... and no more than this many mirrors share the load
+const int max_spread = 3;
+
+static double smooth(double old_value, double new_value)
+{
+	if (old_value < 0)
+		return new_value;
+	return old_value * (1.0 - smoothing) + new_value * smoothing;
+}
+
+ForgeMirrorStats::ForgeMirrorStats(QString path) : m_path(path)
+{
+}
+
+void ForgeMirrorStats::reportLatency(QString mirror_url, qint64 msecs)
+{
+	auto &stats = m_stats[mirror_url];
+	stats.latency = smooth(stats.latency, std::max<qint64>(msecs, 1));
+}
+
+void ForgeMirrorStats::reportDownload(QString mirror_url, qint64 bytes, qint64 msecs)
+{
+	auto &stats = m_stats[mirror_url];
+	// tiny files say more about latency than about throughput
+	if (bytes >= 64 * 1024)
+		stats.throughput = smooth(stats.throughput, double(bytes) / std::max<qint64>(msecs, 1));
+	stats.failures /= 2;
+}
+
+void ForgeMirrorStats::reportFailure(QString mirror_url)
+{
+	auto &stats = m_stats[mirror_url];
+	stats.failures = std::min(stats.failures + 1, 16);
+}
+
+double ForgeMirrorStats::expectedTime(QString mirror_url) const
+{
+	// unknown values are replaced by the average of the known ones
+	double latency_sum = 0, throughput_sum = 0;
+	int latency_count = 0, throughput_count = 0;
+	for (auto &stats : m_stats)
+	{
+		if (stats.latency >= 0)
+		{
+			latency_sum += stats.latency;
+			latency_count++;
+		}
+		if (stats.throughput > 0)
+		{
+			throughput_sum += stats.throughput;
+			throughput_count++;
+		}
+	}
+	double latency = latency_count ? latency_sum / latency_count : default_latency;
+	double throughput = throughput_count ? throughput_sum / throughput_count : default_throughput;
+	int failures = 0;
+
+	auto iter = m_stats.find(mirror_url);
+	if (iter != m_stats.end())
+	{
+		if ((*iter).latency >= 0)
+			latency = (*iter).latency;
+		if ((*iter).throughput > 0)
+			throughput = (*iter).throughput;
+		failures = (*iter).failures;
+	}
+	return (latency + typical_size / throughput) * (1 + failures);
+}
+
+QList<ForgeMirror> ForgeMirrorStats::rank(QList<ForgeMirror> mirrors) const
+{
+	std::stable_sort(mirrors.begin(), mirrors.end(),
+					 [this](const ForgeMirror &a, const ForgeMirror &b)
+	{ return expectedTime(a.mirror_url) < expectedTime(b.mirror_url); });
+	return mirrors;
+}
+
+QList<ForgeMirror> ForgeMirrorStats::spread(const QList<ForgeMirror> &ranked,
+											const ForgeMirrorStats &stats, int n)
+{
+	if (ranked.size() < 2)
+		return ranked;
+
+	int fast = 1;
+	double best = stats.expectedTime(ranked[0].mirror_url);
+	while (fast < ranked.size() && fast < max_spread &&
+		   stats.expectedTime(ranked[fast].mirror_url) <= best * spread_factor)
+	{
+		fast++;
+	}
+
+	QList<ForgeMirror> result;
+	int first = n % fast;
+	result.append(ranked[first]);
+	for (int i = 0; i < ranked.size(); i++)
+	{
+		if (i != first)
+			result.append(ranked[i]);
+	}
+	return result;
+}
+
+bool ForgeMirrorStats::load()
+{
+	QFile file(m_path);
+	if (!file.open(QIODevice::ReadOnly))
+		return false;
+
+	QJsonParseError parseError;
+	QJsonDocument jsonDoc = QJsonDocument::fromJson(file.readAll(), &parseError);
+	file.close();
+	if (parseError.error != QJsonParseError::NoError || !jsonDoc.isObject())
+	{
+		QLOG_WARN() << "Ignoring broken forge mirror statistics in" << m_path;
+		return false;
+	}
+	QJsonObject root = jsonDoc.object();
+	if (root.value("formatVersion").toVariant().toInt() != MIRROR_STATS_FORMAT_VERSION)
+		return false;
+
+	m_stats.clear();
+	for (auto mirrorVal : root.value("mirrors").toArray())
+	{
+		QJsonObject mirrorObj = mirrorVal.toObject();
+		QString url = mirrorObj.value("url").toString();
+		if (url.isEmpty())
+			continue;
+		MirrorStats stats;
+		stats.latency = mirrorObj.value("latency").toDouble(-1);
+		stats.throughput = mirrorObj.value("throughput").toDouble(-1);
+		stats.failures = mirrorObj.value("failures").toVariant().toInt();
+		m_stats[url] = stats;
+	}
+	return true;
+}
+
+bool ForgeMirrorStats::save() const
+{
+	QJsonObject root;
+	root.insert("formatVersion", MIRROR_STATS_FORMAT_VERSION);
+	QJsonArray mirrors;
+	for (auto iter = m_stats.begin(); iter != m_stats.end(); iter++)
+	{
+		QJsonObject mirrorObj;
+		mirrorObj.insert("url", iter.key());
+		mirrorObj.insert("latency", iter.value().latency);
+		mirrorObj.insert("throughput", iter.value().throughput);
+		mirrorObj.insert("failures", iter.value().failures);
+		mirrors.append(mirrorObj);
+	}
+	root.insert("mirrors", mirrors);
+
+	QFile file(m_path);
+	if (!file.open(QIODevice::WriteOnly))
+	{
+		QLOG_ERROR() << "Failed to write forge mirror statistics to" << m_path;
+		return false;
+	}
+	file.write(QJsonDocument(root).toJson());
+	file.close();
+	return true;
+}
@@ -0,0 +1,69 @@
+/* Copyright 2013 MultiMC Contributors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <QString>
+#include <QMap>
+#include <QList>
+#include "ForgeMirror.h"
+
+/*
+ * What we know about the speed of forge mirrors, kept across runs.
+ * Latency comes from probes and from the time to first byte of real downloads,
+ * throughput from finished downloads. Both are smoothed averages.
+ */
+class ForgeMirrorStats
+{
+public:
+	explicit ForgeMirrorStats(QString path);
+
+	/// a probe or a download got its first response after 'msecs'
+	void reportLatency(QString mirror_url, qint64 msecs);
+	/// a download from the mirror finished. 'msecs' is counted from the first byte
+	void reportDownload(QString mirror_url, qint64 bytes, qint64 msecs);
+	/// the mirror couldn't be reached or gave us garbage
+	void reportFailure(QString mirror_url);
+
+	/// estimated time in msecs to get a typical library from the mirror. lower is better
+	double expectedTime(QString mirror_url) const;
+
+	/// sort mirrors from fastest to slowest. mirrors we know nothing about go in the middle
+	QList<ForgeMirror> rank(QList<ForgeMirror> mirrors) const;
+
+	/**
+	 * Order the mirrors for download number 'n' of a batch.
+	 * Downloads are spread over the mirrors that are about as fast as the fastest one.
+	 * The rest follow in ranked order, for failover.
+	 */
+	static QList<ForgeMirror> spread(const QList<ForgeMirror> &ranked,
+									 const ForgeMirrorStats &stats, int n);
+
+	bool load();
+	bool save() const;
+
+private:
+	struct MirrorStats
+	{
+		/// smoothed latency in msecs, < 0 if unknown
+		double latency = -1;
+		/// smoothed throughput in bytes per msec, < 0 if unknown
+		double throughput = -1;
+		/// recent failures, halved by every success
+		int failures = 0;
+	};
+	QString m_path;
+	QMap<QString, MirrorStats> m_stats;
+};
@@ -1,5 +1,6 @@
 #include "MultiMC.h"
 #include "ForgeMirrors.h"
+#include "ForgeMirrorStats.h"
 #include "logger/QsLog.h"
 #include <algorithm>
 #include <random>
@@ -11,10 +12,15 @@ ForgeMirrors::ForgeMirrors(QList<ForgeXzDownloadPtr> &libs, NetJobPtr parent_job
 	m_parent_job = parent_job;
 	m_url = QUrl(mirrorlist);
 	m_status = Job_NotStarted;
+	// the forge libraries wait on this, so get it out of the way early
+	priority = 1;
+	m_probe_timeout.setSingleShot(true);
+	connect(&m_probe_timeout, SIGNAL(timeout()), SLOT(probingDone()));
 }
 
 void ForgeMirrors::start()
 {
+	m_status = Job_InProgress;
 	QLOG_INFO() << "Downloading " << m_url.toString();
 	QNetworkRequest request(m_url);
 	request.setHeader(QNetworkRequest::UserAgentHeader, "MultiMC/5.0 (Uncached)");
@@ -28,6 +34,7 @@ void ForgeMirrors::start()
 	connect(rep, SIGNAL(error(QNetworkReply::NetworkError)),
 			SLOT(downloadError(QNetworkReply::NetworkError)));
 	connect(rep, SIGNAL(readyRead()), SLOT(downloadReadyRead()));
+	watchReply(rep);
 }
 
 void ForgeMirrors::downloadError(QNetworkReply::NetworkError error)
@@ -45,16 +52,14 @@ void ForgeMirrors::downloadFinished()
 	{
 		// nothing went wrong... ?
 		parseMirrorList();
-		return;
 	}
 	// else the download failed, we use a fixed list
 	else
 	{
-		m_status = Job_Finished;
 		m_reply.reset();
 		deferToFixedList();
-		return;
 	}
+	probeMirrors();
 }
 
 void ForgeMirrors::deferToFixedList()
@@ -67,13 +72,10 @@ void ForgeMirrors::deferToFixedList()
 					  "http://files.minecraftforge.net/forge_logo.png",
 					  "https://www.creeperhost.net/link.php?id=1",
 					  "http://new.creeperrepo.net/forge/maven/"});
-	injectDownloads();
-	emit succeeded(index_within_job);
 }
 
 void ForgeMirrors::parseMirrorList()
 {
-	m_status = Job_Finished;
 	auto data = m_reply->readAll();
 	m_reply.reset();
 	auto dataLines = data.split('\n');
@@ -87,21 +89,101 @@ void ForgeMirrors::parseMirrorList()
 	}
 	if(!m_mirrors.size())
 		deferToFixedList();
+}
+
+void ForgeMirrors::probeMirrors()
+{
+	// one mirror, nothing to choose from
+	if (m_mirrors.size() < 2)
+	{
+		probingDone();
+		return;
+	}
+	// ask every mirror for something small and see how long it takes to answer
+	auto worker = MMC->qnam();
+	m_probes_left = m_mirrors.size();
+	m_probe_clock.start();
+	for (auto mirror : m_mirrors)
+	{
+		QNetworkRequest request(QUrl(mirror.mirror_url));
+		request.setHeader(QNetworkRequest::UserAgentHeader, "MultiMC/5.0 (Uncached)");
+		QNetworkReply *rep = worker->head(request);
+		m_probes.append(std::shared_ptr<QNetworkReply>(rep));
+		connect(rep, SIGNAL(finished()), SLOT(probeFinished()));
+	}
+	// don't let a dead mirror hold everything up
+	m_probe_timeout.start(2000);
+}
+
+void ForgeMirrors::probeFinished()
+{
+	QNetworkReply *rep = qobject_cast<QNetworkReply *>(sender());
+	for (int i = 0; i < m_probes.size(); i++)
+	{
+		if (m_probes[i].get() != rep)
+			continue;
+		auto stats = MMC->forgeMirrorStats();
+		// any HTTP answer will do, even an error page. local mirrors have no HTTP status
+		if (rep->attribute(QNetworkRequest::HttpStatusCodeAttribute).isValid() ||
+			rep->error() == QNetworkReply::NoError)
+			stats->reportLatency(m_mirrors[i].mirror_url, m_probe_clock.elapsed());
+		else
+			stats->reportFailure(m_mirrors[i].mirror_url);
+		break;
+	}
+	m_probes_left--;
+	if (m_probes_left == 0)
+		probingDone();
+}
+
+void ForgeMirrors::probingDone()
+{
+	// called once, either when all probes answered or when we got tired of waiting
+	if (m_status == Job_Finished)
+		return;
+	m_status = Job_Finished;
+	m_probe_timeout.stop();
+	auto stats = MMC->forgeMirrorStats();
+	for (int i = 0; i < m_probes.size(); i++)
+	{
+		auto probe = m_probes[i];
+		if (probe->isFinished())
+			continue;
+		// too slow, that counts against it
+		stats->reportLatency(m_mirrors[i].mirror_url, m_probe_clock.elapsed());
+		disconnect(probe.get(), 0, this, 0);
+		probe->abort();
+	}
+	m_probes.clear();
+	stats->save();
+
 	injectDownloads();
 	emit succeeded(index_within_job);
 }
 
 void ForgeMirrors::injectDownloads()
 {
-	// shuffle the mirrors randomly
+	// shuffle the mirrors randomly, so mirrors we know nothing about get a fair chance
 	std::random_device rd;
 	std::mt19937 rng(rd());
 	std::shuffle(m_mirrors.begin(), m_mirrors.end(), rng);
 
+	// then sort them by speed, and spread the libs over the fast ones
+	auto stats = MMC->forgeMirrorStats();
+	auto ranked = stats->rank(m_mirrors);
+	QLOG_INFO() << "Forge mirrors, fastest first:";
+	for (auto mirror : ranked)
+	{
+		QLOG_INFO() << mirror.name << " : " << mirror.mirror_url << " : "
+					<< stats->expectedTime(mirror.mirror_url) << "ms";
+	}
+
 	// tell parent to download the libs
+	int n = 0;
 	for(auto lib: m_libs)
 	{
-		lib->setMirrors(m_mirrors);
+		auto mirrors = ForgeMirrorStats::spread(ranked, *stats, n++);
+		lib->setMirrors(mirrors);
 		m_parent_job->addNetAction(lib);
 	}
 }
@@ -20,7 +20,8 @@
 #include "ForgeXzDownload.h"
 #include "NetJob.h"
 #include <QFile>
-#include <QTemporaryFile>
+#include <QTimer>
+#include <QElapsedTimer>
 typedef std::shared_ptr<class ForgeMirrors> ForgeMirrorsPtr;
 
 class ForgeMirrors : public NetAction
@@ -47,11 +48,22 @@ slots:
 	virtual void downloadFinished();
 	virtual void downloadReadyRead();
 
+	void probeFinished();
+	void probingDone();
+
 private:
 	void parseMirrorList();
 	void deferToFixedList();
+	void probeMirrors();
 	void injectDownloads();
 
+private:
+	/// latency probes, one per mirror
+	QList<std::shared_ptr<QNetworkReply>> m_probes;
+	int m_probes_left = 0;
+	QElapsedTimer m_probe_clock;
+	QTimer m_probe_timeout;
+
 public
 slots:
 	virtual void start();
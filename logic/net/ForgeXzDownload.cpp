@@ -15,20 +15,29 @@
 
 #include "MultiMC.h"
 #include "ForgeXzDownload.h"
+#include "ForgeMirrorStats.h"
 #include <pathutils.h>
 
-#include <QCryptographicHash>
 #include <QFileInfo>
 #include <QDateTime>
 #include "logger/QsLog.h"
+#include <settingsobject.h>
+#include <algorithm>
 
 ForgeXzDownload::ForgeXzDownload(QString relative_path, MetaEntryPtr entry) : NetAction()
 {
 	m_entry = entry;
 	m_target_path = entry->getFullPath();
-	m_pack200_xz_file.setFileTemplate("./dl_temp.XXXXXX");
 	m_status = Job_NotStarted;
 	m_url_path = relative_path;
+	m_hedge_timer.setSingleShot(true);
+	connect(&m_hedge_timer, SIGNAL(timeout()), SLOT(startHedge()));
+}
+
+ForgeXzDownload::~ForgeXzDownload()
+{
+	dropHedge();
+	cancelUnpacker();
 }
 
 void ForgeXzDownload::setMirrors(QList<ForgeMirror> &mirrors)
@@ -60,31 +69,106 @@ void ForgeXzDownload::start()
 		emit failed(index_within_job);
 		return;
 	}
+	// another job may be getting the same library already
+	if (followRunningDownload("cache:" + m_entry->base + "/" + m_entry->path))
+		return;
+
+	// the data is decompressed as it arrives, so every attempt needs a fresh unpacker
+	cancelUnpacker();
+	m_unpacker = ForgeXzUnpacker::create(m_target_path);
+	connect(m_unpacker.get(), SIGNAL(finished(bool)), SLOT(unpackFinished(bool)),
+			Qt::QueuedConnection);
+
+	dropHedge();
+	m_first_byte_time = -1;
+	m_bytes_received = 0;
+	m_clock.start();
+	m_reply = std::shared_ptr<QNetworkReply>(makeRequest(m_url));
+
+	// if the mirror takes too long to answer, we may ask another one too
+	int hedge_delay = MMC->settings()->get("ForgeMirrorHedgeDelay").toInt();
+	if (hedge_delay > 0 && m_mirrors.size() > 1)
+		m_hedge_timer.start(hedge_delay);
+}
 
-	QLOG_INFO() << "Downloading " << m_url.toString();
-	QNetworkRequest request(m_url);
+QNetworkReply *ForgeXzDownload::makeRequest(QUrl url)
+{
+	QLOG_INFO() << "Downloading " << url.toString();
+	QNetworkRequest request(url);
 	request.setRawHeader(QString("If-None-Match").toLatin1(), m_entry->etag.toLatin1());
 	request.setHeader(QNetworkRequest::UserAgentHeader, "MultiMC/5.0 (Cached)");
 
 	auto worker = MMC->qnam();
 	QNetworkReply *rep = worker->get(request);
 
-	m_reply = std::shared_ptr<QNetworkReply>(rep);
 	connect(rep, SIGNAL(downloadProgress(qint64, qint64)),
 			SLOT(downloadProgress(qint64, qint64)));
 	connect(rep, SIGNAL(finished()), SLOT(downloadFinished()));
 	connect(rep, SIGNAL(error(QNetworkReply::NetworkError)),
 			SLOT(downloadError(QNetworkReply::NetworkError)));
 	connect(rep, SIGNAL(readyRead()), SLOT(downloadReadyRead()));
+	watchReply(rep);
+	return rep;
+}
+
+void ForgeXzDownload::startHedge()
+{
+	// the first mirror already answered, or gave up
+	if (!m_reply || m_first_byte_time >= 0 || m_hedge_reply)
+		return;
+	m_hedge_mirror_index = (m_mirror_index + 1) % m_mirrors.size();
+	QLOG_INFO() << "Mirror " << m_mirrors[m_mirror_index].name << " is slow, also trying "
+				<< m_mirrors[m_hedge_mirror_index].name;
+	m_hedge_reply = std::shared_ptr<QNetworkReply>(makeRequest(mirrorUrl(m_hedge_mirror_index)));
+}
+
+void ForgeXzDownload::promoteHedge()
+{
+	// the hedge answered first. it takes over, and the slow mirror gets the blame
+	MMC->forgeMirrorStats()->reportLatency(m_mirrors[m_mirror_index].mirror_url,
+										   m_clock.elapsed());
+	disconnect(m_reply.get(), 0, this, 0);
+	m_reply->abort();
+	m_reply = m_hedge_reply;
+	m_hedge_reply.reset();
+	m_mirror_index = m_hedge_mirror_index;
+	m_url = mirrorUrl(m_mirror_index);
+	m_status = Job_InProgress;
+}
+
+void ForgeXzDownload::dropHedge()
+{
+	m_hedge_timer.stop();
+	if (!m_hedge_reply)
+		return;
+	disconnect(m_hedge_reply.get(), 0, this, 0);
+	m_hedge_reply->abort();
+	m_hedge_reply.reset();
+}
+
+void ForgeXzDownload::leaderFinished(bool success)
+{
+	if (success)
+	{
+		// the other download updated the cache, most likely with what we wanted
+		m_entry = MMC->metacache()->resolveEntry(m_entry->base, m_entry->path);
+		m_target_path = m_entry->getFullPath();
+	}
+	start();
 }
 
 void ForgeXzDownload::downloadProgress(qint64 bytesReceived, qint64 bytesTotal)
 {
+	if (sender() != m_reply.get())
+		return;
 	emit progress(index_within_job, bytesReceived, bytesTotal);
 }
 
 void ForgeXzDownload::downloadError(QNetworkReply::NetworkError error)
 {
+	// the hedge failing doesn't matter, downloadFinished() drops it
+	if (sender() != m_reply.get())
+		return;
 	// error happened during download.
 	// TODO: log the reason why
 	m_status = Job_Failed;
@@ -93,6 +177,9 @@ void ForgeXzDownload::downloadError(QNetworkReply::NetworkError error)
 void ForgeXzDownload::failAndTryNextMirror()
 {
 	m_status = Job_Failed;
+	auto stats = MMC->forgeMirrorStats();
+	stats->reportFailure(m_mirrors[m_mirror_index].mirror_url);
+	stats->save();
 	int next = m_mirror_index + 1;
 	if(m_mirrors.size() == next)
 		m_mirror_index = 0;
@@ -103,6 +190,21 @@ void ForgeXzDownload::failAndTryNextMirror()
 	emit failed(index_within_job);
 }
 
+bool ForgeXzDownload::tryOtherMirror()
+{
+	if (m_mirrors.size() < 2)
+		return false;
+	m_mirror_index = (m_mirror_index + 1) % m_mirrors.size();
+	updateUrl();
+	return true;
+}
+
+QUrl ForgeXzDownload::mirrorUrl(int index)
+{
+	QString aggregate = m_mirrors[index].mirror_url + m_url_path + ".pack.xz";
+	return QUrl(aggregate);
+}
+
 void ForgeXzDownload::updateUrl()
 {
 	QLOG_INFO() << "Updating URL for " << m_url_path;
@@ -110,242 +212,108 @@ void ForgeXzDownload::updateUrl()
 	{
 		QLOG_INFO() << "Possible: " << possible.name << " : " << possible.mirror_url;
 	}
-	QString aggregate = m_mirrors[m_mirror_index].mirror_url + m_url_path + ".pack.xz";
-	m_url = QUrl(aggregate);
+	m_url = mirrorUrl(m_mirror_index);
 }
 
 void ForgeXzDownload::downloadFinished()
 {
-	//TEST: defer to other possible mirrors (autofail the first one)
-	/*
-	QLOG_INFO() <<"dl " << index_within_job << " mirror " << m_mirror_index;
-	if( m_mirror_index == 0)
+	QNetworkReply *rep = qobject_cast<QNetworkReply *>(sender());
+	if (m_hedge_reply && rep == m_hedge_reply.get())
 	{
-		QLOG_INFO() <<"dl " << index_within_job << " AUTOFAIL";
-		m_status = Job_Failed;
-		m_pack200_xz_file.close();
-		m_pack200_xz_file.remove();
-		m_reply.reset();
-		failAndTryNextMirror();
+		// the hedge ended before giving us anything. never mind.
+		dropHedge();
 		return;
 	}
-	*/
+	if (m_status == Job_Failed && m_hedge_reply)
+	{
+		// the first mirror failed before sending anything, but the hedge is still going
+		MMC->forgeMirrorStats()->reportFailure(m_mirrors[m_mirror_index].mirror_url);
+		promoteHedge();
+		return;
+	}
+	dropHedge();
 
 	// if the download succeeded
 	if (m_status != Job_Failed)
 	{
-		// nothing went wrong...
-		m_status = Job_Finished;
-		if (m_pack200_xz_file.isOpen())
-		{
-			// we actually downloaded something! process and isntall it
-			decompressAndInstall();
-			return;
-		}
-		else
-		{
-			// something bad happened -- on the local machine!
-			m_status = Job_Failed;
-			m_pack200_xz_file.remove();
-			m_reply.reset();
-			emit failed(index_within_job);
-			return;
-		}
-	}
-	// else the download failed
-	else
-	{
-		m_status = Job_Failed;
-		m_pack200_xz_file.close();
-		m_pack200_xz_file.remove();
+		// nothing went wrong... let the unpacker finish the job
+		m_download_time = m_clock.elapsed() - std::max<qint64>(m_first_byte_time, 0);
+		m_etag = m_reply->rawHeader("ETag").constData();
 		m_reply.reset();
-		failAndTryNextMirror();
+		m_unpacker->endOfData();
 		return;
 	}
+	// else the download failed
+	cancelUnpacker();
+	m_reply.reset();
+	failAndTryNextMirror();
 }
 
 void ForgeXzDownload::downloadReadyRead()
 {
-
-	if (!m_pack200_xz_file.isOpen())
+	QNetworkReply *rep = qobject_cast<QNetworkReply *>(sender());
+	if (m_hedge_reply && rep == m_hedge_reply.get())
+		promoteHedge();
+	if (m_first_byte_time < 0)
 	{
-		if (!m_pack200_xz_file.open())
-		{
-			/*
-			* Can't open the file... the job failed
-			*/
-			m_reply->abort();
-			emit failed(index_within_job);
-			return;
-		}
+		// the race is over
+		dropHedge();
+		m_first_byte_time = m_clock.elapsed();
+		MMC->forgeMirrorStats()->reportLatency(m_mirrors[m_mirror_index].mirror_url,
+											   m_first_byte_time);
 	}
-	m_pack200_xz_file.write(m_reply->readAll());
+	QByteArray data = m_reply->readAll();
+	m_bytes_received += data.size();
+	// already failed, waiting for the abort to go through
+	if (m_status == Job_Failed)
+		return;
+	m_unpacker->addData(data);
 }
 
-#include "xz.h"
-#include "unpack200.h"
-#include <stdexcept>
-
-const size_t buffer_size = 8196;
+void ForgeXzDownload::cancelUnpacker()
+{
+	if (!m_unpacker)
+		return;
+	disconnect(m_unpacker.get(), 0, this, 0);
+	m_unpacker->cancel();
+	m_unpacker.reset();
+}
 
-void ForgeXzDownload::decompressAndInstall()
+void ForgeXzDownload::unpackFinished(bool success)
 {
-	// rewind the downloaded temp file
-	m_pack200_xz_file.seek(0);
-	// de-xz'd file
-	QTemporaryFile pack200_file("./dl_temp.XXXXXX");
-	pack200_file.open();
-
-	bool xz_success = false;
-	// first, de-xz
+	// a result from an attempt we gave up on
+	if (!m_unpacker || sender() != m_unpacker.get())
+		return;
+
+	if (!success)
 	{
-		uint8_t in[buffer_size];
-		uint8_t out[buffer_size];
-		struct xz_buf b;
-		struct xz_dec *s;
-		enum xz_ret ret;
-		xz_crc32_init();
-		xz_crc64_init();
-		s = xz_dec_init(XZ_DYNALLOC, 1 << 26);
-		if (s == nullptr)
+		m_status = Job_Failed;
+		if (m_reply)
 		{
-			xz_dec_end(s);
-			failAndTryNextMirror();
+			// bad data, no point in downloading the rest. downloadFinished() takes it from here
+			QMetaObject::invokeMethod(m_reply.get(), "abort", Qt::QueuedConnection);
 			return;
 		}
-		b.in = in;
-		b.in_pos = 0;
-		b.in_size = 0;
-		b.out = out;
-		b.out_pos = 0;
-		b.out_size = buffer_size;
-		while (!xz_success)
-		{
-			if (b.in_pos == b.in_size)
-			{
-				b.in_size = m_pack200_xz_file.read((char *)in, sizeof(in));
-				b.in_pos = 0;
-			}
-
-			ret = xz_dec_run(s, &b);
-
-			if (b.out_pos == sizeof(out))
-			{
-				if (pack200_file.write((char *)out, b.out_pos) != b.out_pos)
-				{
-					// msg = "Write error\n";
-					xz_dec_end(s);
-					failAndTryNextMirror();
-					return;
-				}
-
-				b.out_pos = 0;
-			}
-
-			if (ret == XZ_OK)
-				continue;
-
-			if (ret == XZ_UNSUPPORTED_CHECK)
-			{
-				// unsupported check. this is OK, but we should log this
-				continue;
-			}
-
-			if (pack200_file.write((char *)out, b.out_pos) != b.out_pos)
-			{
-				// write error
-				pack200_file.close();
-				xz_dec_end(s);
-				return;
-			}
-
-			switch (ret)
-			{
-			case XZ_STREAM_END:
-				xz_dec_end(s);
-				xz_success = true;
-				break;
-
-			case XZ_MEM_ERROR:
-				QLOG_ERROR() << "Memory allocation failed\n";
-				xz_dec_end(s);
-				failAndTryNextMirror();
-				return;
-
-			case XZ_MEMLIMIT_ERROR:
-				QLOG_ERROR() << "Memory usage limit reached\n";
-				xz_dec_end(s);
-				failAndTryNextMirror();
-				return;
-
-			case XZ_FORMAT_ERROR:
-				QLOG_ERROR() << "Not a .xz file\n";
-				xz_dec_end(s);
-				failAndTryNextMirror();
-				return;
-
-			case XZ_OPTIONS_ERROR:
-				QLOG_ERROR() << "Unsupported options in the .xz headers\n";
-				xz_dec_end(s);
-				failAndTryNextMirror();
-				return;
-
-			case XZ_DATA_ERROR:
-			case XZ_BUF_ERROR:
-				QLOG_ERROR() << "File is corrupt\n";
-				xz_dec_end(s);
-				failAndTryNextMirror();
-				return;
-
-			default:
-				QLOG_ERROR() << "Bug!\n";
-				xz_dec_end(s);
-				failAndTryNextMirror();
-				return;
-			}
-		}
-	}
-	m_pack200_xz_file.remove();
-
-	// revert pack200
-	pack200_file.close();
-	QString pack_name = pack200_file.fileName();
-	try
-	{
-		unpack_200(pack_name.toStdString(), m_target_path.toStdString());
-	}
-	catch (std::runtime_error &err)
-	{
-		m_status = Job_Failed;
-		QLOG_ERROR() << "Error unpacking " << pack_name.toUtf8() << " : " << err.what();
-		QFile f(m_target_path);
-		if (f.exists())
-			f.remove();
+		cancelUnpacker();
 		failAndTryNextMirror();
 		return;
 	}
-	pack200_file.remove();
 
-	QFile jar_file(m_target_path);
+	m_status = Job_Finished;
+	m_entry->md5sum = m_unpacker->md5sum();
+	m_unpacker.reset();
 
-	if (!jar_file.open(QIODevice::ReadOnly))
-	{
-		jar_file.remove();
-		failAndTryNextMirror();
-		return;
-	}
-	m_entry->md5sum = QCryptographicHash::hash(jar_file.readAll(), QCryptographicHash::Md5)
-						  .toHex()
-						  .constData();
-	jar_file.close();
+	auto stats = MMC->forgeMirrorStats();
+	stats->reportDownload(m_mirrors[m_mirror_index].mirror_url, m_bytes_received,
+						  m_download_time);
+	stats->save();
 
 	QFileInfo output_file_info(m_target_path);
-	m_entry->etag = m_reply->rawHeader("ETag").constData();
+	m_entry->etag = m_etag;
 	m_entry->local_changed_timestamp =
 		output_file_info.lastModified().toUTC().toMSecsSinceEpoch();
 	m_entry->stale = false;
 	MMC->metacache()->updateEntry(m_entry);
 
-	m_reply.reset();
 	emit succeeded(index_within_job);
 }
@@ -18,8 +18,10 @@
 #include "NetAction.h"
 #include "HttpMetaCache.h"
 #include <QFile>
-#include <QTemporaryFile>
+#include <QTimer>
+#include <QElapsedTimer>
 #include "ForgeMirror.h"
+#include "ForgeXzUnpacker.h"
 
 typedef std::shared_ptr<class ForgeXzDownload> ForgeXzDownloadPtr;
 
@@ -30,8 +32,10 @@ public:
 	MetaEntryPtr m_entry;
 	/// if saving to file, use the one specified in this string
 	QString m_target_path;
-	/// this is the output file, if any
-	QTemporaryFile m_pack200_xz_file;
+	/// turns the downloaded data into the jar, off the main thread
+	ForgeXzUnpackerPtr m_unpacker;
+	/// ETag of the finished download, kept until the jar is unpacked
+	QString m_etag;
 	/// mirror index (NOT OPTICS, I SWEAR)
 	int m_mirror_index = 0;
 	/// list of mirrors to use. Mirror has the url base
@@ -39,13 +43,26 @@ public:
 	/// path relative to the mirror base
 	QString m_url_path;
 
+	/// duplicate request to the next mirror, sent when the first one is slow to answer
+	std::shared_ptr<QNetworkReply> m_hedge_reply;
+	int m_hedge_mirror_index = 0;
+	QTimer m_hedge_timer;
+
+	/// for the mirror statistics
+	QElapsedTimer m_clock;
+	qint64 m_first_byte_time = -1;
+	qint64 m_download_time = 0;
+	qint64 m_bytes_received = 0;
+
 public:
 	explicit ForgeXzDownload(QString relative_path, MetaEntryPtr entry);
+	virtual ~ForgeXzDownload();
 	static ForgeXzDownloadPtr make(QString relative_path, MetaEntryPtr entry)
 	{
 		return ForgeXzDownloadPtr(new ForgeXzDownload(relative_path, entry));
 	}
 	void setMirrors(QList<ForgeMirror> & mirrors);
+	virtual bool tryOtherMirror();
 
 protected
 slots:
@@ -53,13 +70,22 @@ slots:
 	virtual void downloadError(QNetworkReply::NetworkError error);
 	virtual void downloadFinished();
 	virtual void downloadReadyRead();
+	void unpackFinished(bool success);
+	void startHedge();
+
+protected:
+	virtual void leaderFinished(bool success);
 
 public
 slots:
 	virtual void start();
 
 private:
-	void decompressAndInstall();
+	QNetworkReply *makeRequest(QUrl url);
+	QUrl mirrorUrl(int index);
+	void promoteHedge();
+	void dropHedge();
+	void cancelUnpacker();
 	void failAndTryNextMirror();
 	void updateUrl();
 };
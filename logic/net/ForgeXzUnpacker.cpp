@@ -0,0 +1,295 @@
+/* Copyright 2013 MultiMC Contributors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ForgeXzUnpacker.h"
+#include "NetAction.h"
+#include "FileSink.h"
+
+#include <QRunnable>
+#include <QMutexLocker>
+#include <QTemporaryFile>
+#include <QCryptographicHash>
+#include <QFile>
+#include "logger/QsLog.h"
+
+#include "xz.h"
+#include "unpack200.h"
+#include <stdexcept>
+#include <algorithm>
+#include <cstring>
+
+const size_t buffer_size = 8196;
+
+class ForgeXzUnpackerRunner : public QRunnable
+{
+public:
+	ForgeXzUnpackerRunner(ForgeXzUnpackerPtr unpacker) : m_unpacker(unpacker)
+	{
+	}
+	virtual void run()
+	{
+		m_unpacker->work();
+	}
+
+private:
+	ForgeXzUnpackerPtr m_unpacker;
+};
+
+ForgeXzUnpackerPtr ForgeXzUnpacker::create(QString target_path)
+{
+	return ForgeXzUnpackerPtr(new ForgeXzUnpacker(target_path), [](ForgeXzUnpacker *unpacker)
+	{
+		// runners hold references too, and they may let go last, on a worker thread
+		unpacker->deleteLater();
+	});
+}
+
+ForgeXzUnpacker::ForgeXzUnpacker(QString target_path) : QObject(0)
+{
+	static bool crc_initialized = false;
+	if (!crc_initialized)
+	{
+		xz_crc32_init();
+		xz_crc64_init();
+		crc_initialized = true;
+	}
+	m_target_path = target_path;
+	m_decoder = xz_dec_init(XZ_DYNALLOC, 1 << 26);
+	if (!m_decoder)
+	{
+		QLOG_ERROR() << "Memory allocation failed\n";
+		m_failed = true;
+	}
+}
+
+ForgeXzUnpacker::~ForgeXzUnpacker()
+{
+	if (m_decoder)
+		xz_dec_end(m_decoder);
+}
+
+void ForgeXzUnpacker::addData(QByteArray data)
+{
+	QMutexLocker locker(&m_lock);
+	if (m_done || m_end_of_data)
+		return;
+	m_queue.append(data);
+	schedule();
+}
+
+void ForgeXzUnpacker::endOfData()
+{
+	QMutexLocker locker(&m_lock);
+	m_end_of_data = true;
+	schedule();
+}
+
+void ForgeXzUnpacker::cancel()
+{
+	QMutexLocker locker(&m_lock);
+	m_canceled.store(1);
+	m_queue.clear();
+}
+
+void ForgeXzUnpacker::schedule()
+{
+	if (m_running || m_done || m_canceled.load())
+		return;
+	m_running = true;
+	NetAction::workerPool()->start(new ForgeXzUnpackerRunner(shared_from_this()));
+}
+
+void ForgeXzUnpacker::work()
+{
+	while (true)
+	{
+		QByteArray chunk;
+		{
+			QMutexLocker locker(&m_lock);
+			if (m_canceled.load())
+			{
+				m_running = false;
+				return;
+			}
+			if (m_failed || (m_queue.isEmpty() && m_end_of_data))
+			{
+				// no point in taking any more data
+				m_queue.clear();
+				m_done = true;
+				break;
+			}
+			if (m_queue.isEmpty())
+			{
+				// wait for more. the next addData() will schedule us again
+				m_running = false;
+				return;
+			}
+			chunk = m_queue.takeFirst();
+		}
+		if (!decompressChunk(chunk))
+			m_failed = true;
+	}
+
+	if (m_failed)
+	{
+		emit finished(false);
+		return;
+	}
+	if (!m_xz_done)
+	{
+		// the xz stream ended prematurely, or there was none at all
+		QLOG_ERROR() << "Incomplete xz stream for " << m_target_path;
+		emit finished(false);
+		return;
+	}
+	emit finished(unpack());
+}
+
+bool ForgeXzUnpacker::decompressChunk(const QByteArray &data)
+{
+	if (m_xz_done)
+	{
+		// trailing garbage after the end of the stream. ignore it, like we did before.
+		return true;
+	}
+	uint8_t out[buffer_size];
+	struct xz_buf b;
+	b.in = (const uint8_t *)data.constData();
+	b.in_pos = 0;
+	b.in_size = data.size();
+	b.out = out;
+	b.out_pos = 0;
+	b.out_size = buffer_size;
+	while (true)
+	{
+		enum xz_ret ret = xz_dec_run(m_decoder, &b);
+
+		// flush what we have so far into the pack200 buffer
+		bool out_full = b.out_pos == b.out_size;
+		m_pack200_data.append((const char *)out, b.out_pos);
+		b.out_pos = 0;
+
+		switch (ret)
+		{
+		case XZ_OK:
+			// input used up and nothing more to flush, wait for more
+			if (b.in_pos == b.in_size && !out_full)
+				return true;
+			continue;
+
+		case XZ_UNSUPPORTED_CHECK:
+			// unsupported check. this is OK, but we should log this
+			continue;
+
+		case XZ_STREAM_END:
+			xz_dec_end(m_decoder);
+			m_decoder = nullptr;
+			m_xz_done = true;
+			return true;
+
+		case XZ_MEM_ERROR:
+			QLOG_ERROR() << "Memory allocation failed\n";
+			return false;
+
+		case XZ_MEMLIMIT_ERROR:
+			QLOG_ERROR() << "Memory usage limit reached\n";
+			return false;
+
+		case XZ_FORMAT_ERROR:
+			QLOG_ERROR() << "Not a .xz file\n";
+			return false;
+
+		case XZ_OPTIONS_ERROR:
+			QLOG_ERROR() << "Unsupported options in the .xz headers\n";
+			return false;
+
+		case XZ_DATA_ERROR:
+			QLOG_ERROR() << "File is corrupt\n";
+			return false;
+
+		case XZ_BUF_ERROR:
+			// no progress possible - the stream is done, or we need more input
+			if (b.in_pos == b.in_size)
+				return true;
+			QLOG_ERROR() << "File is corrupt\n";
+			return false;
+
+		default:
+			QLOG_ERROR() << "Bug!\n";
+			return false;
+		}
+	}
+}
+
+bool ForgeXzUnpacker::unpack()
+{
+	// a retry of the same download may be running by now, so don't write over the target
+	// until we know we're still wanted
+	QString temp_path;
+	{
+		QTemporaryFile temp(m_target_path + ".XXXXXX");
+		temp.setAutoRemove(false);
+		if (!temp.open())
+		{
+			QLOG_ERROR() << "Can't create a temporary file for " << m_target_path;
+			return false;
+		}
+		temp_path = temp.fileName();
+	}
+
+	// revert pack200, straight from memory, hashing the jar as it's being written
+	QCryptographicHash md5(QCryptographicHash::Md5);
+	int64_t read_pos = 0;
+	auto input = [&](void *buf, int64_t len) -> int64_t
+	{
+		if (m_canceled.load())
+			return 0;
+		int64_t copied = std::min(len, (int64_t)m_pack200_data.size() - read_pos);
+		memcpy(buf, m_pack200_data.constData() + read_pos, copied);
+		read_pos += copied;
+		return copied;
+	};
+	auto observer = [&](const void *buf, int64_t len)
+	{
+		md5.addData((const char *)buf, len);
+	};
+	try
+	{
+		unpack_200(input, temp_path.toStdString(), observer);
+	}
+	catch (std::runtime_error &err)
+	{
+		QLOG_ERROR() << "Error unpacking " << m_target_path << " : " << err.what();
+		QFile::remove(temp_path);
+		return false;
+	}
+	m_pack200_data.clear();
+
+	QMutexLocker locker(&m_lock);
+	if (m_canceled.load())
+	{
+		QFile::remove(temp_path);
+		return false;
+	}
+	if (!FileSink::replaceFile(temp_path, m_target_path))
+	{
+		QLOG_ERROR() << "Can't move the unpacked jar to " << m_target_path;
+		QFile::remove(temp_path);
+		return false;
+	}
+	FileSink::syncLater(m_target_path);
+	m_md5sum = md5.result().toHex().constData();
+	return true;
+}
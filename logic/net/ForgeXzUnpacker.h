@@ -0,0 +1,93 @@
+/* Copyright 2013 MultiMC Contributors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <QObject>
+#include <QByteArray>
+#include <QList>
+#include <QMutex>
+#include <QAtomicInt>
+#include <memory>
+
+struct xz_dec;
+
+typedef std::shared_ptr<class ForgeXzUnpacker> ForgeXzUnpackerPtr;
+
+/*
+ * The CPU heavy half of a ForgeXzDownload: turns a .pack.xz stream into a jar.
+ *
+ * Data is handed over from the thread that owns the download as it arrives. The xz decoding
+ * and the pack200 unpacking run on NetAction::workerPool(), so unrelated libraries are
+ * processed in parallel. finished() is emitted from the worker thread, so connect to it
+ * with a queued connection. One unpacker is used for one download attempt.
+ *
+ * The last reference may be dropped by a worker, so always make one with create(), which
+ * has it deleted on the thread it lives on.
+ */
+class ForgeXzUnpacker : public QObject, public std::enable_shared_from_this<ForgeXzUnpacker>
+{
+	Q_OBJECT
+public:
+	static ForgeXzUnpackerPtr create(QString target_path);
+	virtual ~ForgeXzUnpacker();
+
+	/// queue more compressed data for decoding
+	void addData(QByteArray data);
+	/// all the data is in. the jar gets written and finished() emitted
+	void endOfData();
+	/// stop as soon as possible. finished() may still be emitted, but should be ignored
+	void cancel();
+
+	/// MD5 of the written jar, valid after a successful finish
+	QString md5sum() const
+	{
+		return m_md5sum;
+	}
+
+signals:
+	/// emitted once, either when the jar is written, or when the input turns out to be bad
+	void finished(bool success);
+
+private:
+	explicit ForgeXzUnpacker(QString target_path);
+	friend class ForgeXzUnpackerRunner;
+	/// make sure a runner is working on this. call with the lock held
+	void schedule();
+	/// worker side: drain the queue, then unpack when all data is in
+	void work();
+	bool decompressChunk(const QByteArray &data);
+	bool unpack();
+
+private:
+	QString m_target_path;
+
+	/// shared with the worker, protected by m_lock
+	QMutex m_lock;
+	QList<QByteArray> m_queue;
+	bool m_end_of_data = false;
+	bool m_running = false;
+	bool m_done = false;
+	QAtomicInt m_canceled;
+
+	/// worker only
+	xz_dec *m_decoder = nullptr;
+	bool m_xz_done = false;
+	bool m_failed = false;
+	QByteArray m_pack200_data;
+
+	/// written by the worker before finished()
+	QString m_md5sum;
+};
@@ -23,6 +23,14 @@
 #include <QSaveFile>
 #include <QDateTime>
 #include <QCryptographicHash>
+#include <QThread>
+#include <QSet>
+#include <QtEndian>
+#include <algorithm>
+
+#ifndef Q_OS_WIN
+#include <sys/stat.h>
+#endif
 
 #include "logger/QsLog.h"
 
@@ -30,6 +38,221 @@
 #include <QJsonArray>
 #include <QJsonObject>
 
+namespace
+{
+const char snapshot_magic[4] = {'M', 'M', 'C', 'I'};
+const quint32 snapshot_version = 3;
+// magic, version, entry count, reserved
+const int snapshot_header_size = 16;
+
+enum JournalOp
+{
+	Journal_Put = 1,
+	Journal_Remove = 2
+};
+
+void putString(QByteArray &out, const QString &str)
+{
+	QByteArray utf = str.toUtf8();
+	uchar len[4];
+	qToLittleEndian<quint32>(utf.size(), len);
+	out.append((const char *)len, 4);
+	out.append(utf);
+}
+
+bool getString(const uchar *&pos, const uchar *end, QByteArray &out)
+{
+	if (end - pos < 4)
+		return false;
+	quint32 len = qFromLittleEndian<quint32>(pos);
+	pos += 4;
+	if (quint32(end - pos) < len)
+		return false;
+	out = QByteArray((const char *)pos, len);
+	pos += len;
+	return true;
+}
+
+/*
+ * A record is: base, path, md5sum, etag, remote timestamp (all length-prefixed UTF-8)
+ * and the local timestamp, size and inode (64 bit each). Everything is little endian.
+ */
+QByteArray serializeEntry(const MetaEntry &entry)
+{
+	QByteArray out;
+	putString(out, entry.base);
+	putString(out, entry.path);
+	putString(out, entry.md5sum);
+	putString(out, entry.etag);
+	putString(out, entry.remote_changed_timestamp);
+	uchar stamp[24];
+	qToLittleEndian<qint64>(entry.local_changed_timestamp, stamp);
+	qToLittleEndian<qint64>(entry.local_size, stamp + 8);
+	qToLittleEndian<quint64>(entry.local_inode, stamp + 16);
+	out.append((const char *)stamp, 24);
+	return out;
+}
+
+MetaEntryPtr deserializeEntry(const uchar *pos, const uchar *end)
+{
+	QByteArray base, path, md5sum, etag, remote;
+	if (!getString(pos, end, base) || !getString(pos, end, path) ||
+		!getString(pos, end, md5sum) || !getString(pos, end, etag) ||
+		!getString(pos, end, remote) || end - pos < 24)
+		return MetaEntryPtr();
+	auto entry = new MetaEntry;
+	entry->base = QString::fromUtf8(base);
+	entry->path = QString::fromUtf8(path);
+	entry->md5sum = QString::fromUtf8(md5sum);
+	entry->etag = QString::fromUtf8(etag);
+	entry->remote_changed_timestamp = QString::fromUtf8(remote);
+	entry->local_changed_timestamp = qFromLittleEndian<qint64>(pos);
+	entry->local_size = qFromLittleEndian<qint64>(pos + 8);
+	entry->local_inode = qFromLittleEndian<quint64>(pos + 16);
+	// presumed innocent until closer examination
+	entry->stale = false;
+	return MetaEntryPtr(entry);
+}
+
+// length of the record at pos, or -1 if it's broken
+qint64 recordLength(const uchar *pos, const uchar *end)
+{
+	const uchar *start = pos;
+	QByteArray dummy;
+	for (int i = 0; i < 5; i++)
+	{
+		if (!getString(pos, end, dummy))
+			return -1;
+	}
+	if (end - pos < 24)
+		return -1;
+	return pos + 24 - start;
+}
+
+// the sort key of an entry. '\0' can't be in either part, so this orders by base, then path
+QByteArray entryKey(const QByteArray &base, const QByteArray &path)
+{
+	QByteArray key = base;
+	key.append('\0');
+	key.append(path);
+	return key;
+}
+
+bool readKey(const uchar *pos, const uchar *end, QByteArray &key)
+{
+	QByteArray base, path;
+	if (!getString(pos, end, base) || !getString(pos, end, path))
+		return false;
+	key = entryKey(base, path);
+	return true;
+}
+
+bool checkSnapshotHeader(const uchar *data, qint64 size, quint32 &count)
+{
+	if (size < snapshot_header_size)
+		return false;
+	if (memcmp(data, snapshot_magic, 4) != 0)
+		return false;
+	if (qFromLittleEndian<quint32>(data + 4) != snapshot_version)
+		return false;
+	count = qFromLittleEndian<quint32>(data + 8);
+	return snapshot_header_size + qint64(count) * 4 <= size;
+}
+
+quint64 fileInode(const QString &path)
+{
+#ifndef Q_OS_WIN
+	struct stat info;
+	if (stat(QFile::encodeName(path).constData(), &info) == 0)
+		return info.st_ino;
+#endif
+	return 0;
+}
+}
+
+/*
+ * Merges the old snapshot with everything that changed in memory and writes
+ * the result as a new snapshot file. Runs on its own thread.
+ */
+class MetaCacheCompactor : public QThread
+{
+public:
+	void run()
+	{
+		QList<QPair<QByteArray, QByteArray>> records = m_changed;
+
+		QFile old_file(m_old_snapshot);
+		if (old_file.open(QIODevice::ReadOnly))
+		{
+			QByteArray old_data = old_file.readAll();
+			old_file.close();
+			const uchar *data = (const uchar *)old_data.constData();
+			const uchar *end = data + old_data.size();
+			quint32 count = 0;
+			if (checkSnapshotHeader(data, old_data.size(), count))
+			{
+				for (quint32 i = 0; i < count; i++)
+				{
+					quint32 offset =
+						qFromLittleEndian<quint32>(data + snapshot_header_size + i * 4);
+					if (offset >= quint32(old_data.size()))
+						continue;
+					QByteArray key;
+					if (!readKey(data + offset, end, key) || m_overridden.contains(key))
+						continue;
+					qint64 length = recordLength(data + offset, end);
+					if (length < 0)
+						continue;
+					records.append(qMakePair(key, QByteArray((const char *)data + offset, length)));
+				}
+			}
+		}
+
+		std::sort(records.begin(), records.end(),
+				  [](const QPair<QByteArray, QByteArray> &left,
+					 const QPair<QByteArray, QByteArray> &right)
+		{ return left.first < right.first; });
+
+		QByteArray header(snapshot_header_size, '\0');
+		memcpy(header.data(), snapshot_magic, 4);
+		qToLittleEndian<quint32>(snapshot_version, (uchar *)header.data() + 4);
+		qToLittleEndian<quint32>(records.size(), (uchar *)header.data() + 8);
+
+		QByteArray index(records.size() * 4, '\0');
+		quint32 offset = snapshot_header_size + index.size();
+		for (int i = 0; i < records.size(); i++)
+		{
+			qToLittleEndian<quint32>(offset, (uchar *)index.data() + i * 4);
+			offset += records[i].second.size();
+		}
+
+		QFile new_file(m_new_snapshot);
+		if (!new_file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+			return;
+		bool ok = new_file.write(header) == header.size() && new_file.write(index) == index.size();
+		for (int i = 0; ok && i < records.size(); i++)
+		{
+			ok = new_file.write(records[i].second) == records[i].second.size();
+		}
+		ok = ok && new_file.flush();
+		new_file.close();
+		if (!ok)
+		{
+			new_file.remove();
+			return;
+		}
+		m_success = true;
+	}
+
+	QString m_old_snapshot;
+	QString m_new_snapshot;
+	/// entries that changed in memory, with their sort keys
+	QList<QPair<QByteArray, QByteArray>> m_changed;
+	/// keys of all the changed and removed entries. these are not taken from the old snapshot
+	QSet<QByteArray> m_overridden;
+	bool m_success = false;
+};
+
 QString MetaEntry::getFullPath()
 {
 	return PathCombine(MMC->metacache()->getBasePath(base), path);
@@ -46,7 +269,14 @@ HttpMetaCache::HttpMetaCache(QString path) : QObject()
 HttpMetaCache::~HttpMetaCache()
 {
 	saveBatchingTimer.stop();
-	SaveNow();
+	// the journal is already on disk. only let a running compaction finish.
+	if (m_compactor)
+	{
+		m_compact_again = false;
+		compactionFinished();
+	}
+	m_journal.close();
+	unmapSnapshot();
 }
 
 MetaEntryPtr HttpMetaCache::getEntry(QString base, QString resource_path)
@@ -58,11 +288,17 @@ MetaEntryPtr HttpMetaCache::getEntry(QString base, QString resource_path)
 		return MetaEntryPtr();
 	}
 	EntryMap &map = m_entries[base];
-	if (map.entry_list.contains(resource_path))
+	auto iter = map.entry_list.find(resource_path);
+	if (iter != map.entry_list.end())
 	{
-		return map.entry_list[resource_path];
+		return *iter;
 	}
-	return MetaEntryPtr();
+	auto entry = snapshotEntry(base, resource_path);
+	if (entry)
+	{
+		map.entry_list[resource_path] = entry;
+	}
+	return entry;
 }
 
 MetaEntryPtr HttpMetaCache::resolveEntry(QString base, QString resource_path,
@@ -77,46 +313,92 @@ MetaEntryPtr HttpMetaCache::resolveEntry(QString base, QString resource_path,
 
 	auto &selected_base = m_entries[base];
 	QString real_path = PathCombine(selected_base.base_path, resource_path);
-	QFileInfo finfo(real_path);
 
-	// is the file really there? if not -> stale
-	if (!finfo.isFile() || !finfo.isReadable())
+	if (!expected_etag.isEmpty() && expected_etag != entry->etag)
 	{
-		// if the file doesn't exist, we disown the entry
-		selected_base.entry_list.remove(resource_path);
+		// if the etag doesn't match expected, we disown the entry
+		removeEntry(base, resource_path);
 		return staleEntry(base, resource_path);
 	}
 
-	if (!expected_etag.isEmpty() && expected_etag != entry->etag)
+	MetaEntry current;
+	auto state = checkFile(real_path, *entry, current);
+	return applyFileState(entry, state, current);
+}
+
+HttpMetaCache::FileState HttpMetaCache::checkFile(QString real_path, const MetaEntry &entry,
+												  MetaEntry &current)
+{
+	QFileInfo finfo(real_path);
+
+	// is the file really there? if not -> stale
+	if (!finfo.isFile() || !finfo.isReadable())
+		return File_Missing;
+
+	current.local_changed_timestamp = finfo.lastModified().toUTC().toMSecsSinceEpoch();
+	current.local_size = finfo.size();
+	current.local_inode = fileInode(real_path);
+
+	bool size_known = entry.local_size >= 0;
+	bool inode_known = entry.local_inode != 0;
+	if (size_known && entry.local_size != current.local_size)
+		return File_Changed;
+
+	if (current.local_changed_timestamp == entry.local_changed_timestamp &&
+		(!inode_known || entry.local_inode == current.local_inode))
 	{
-		// if the etag doesn't match expected, we disown the entry
-		selected_base.entry_list.remove(resource_path);
-		return staleEntry(base, resource_path);
+		// entries from before we kept sizes and inodes get them filled in
+		if (size_known && (inode_known || !current.local_inode))
+			return File_Unchanged;
+		return File_Touched;
 	}
 
 	// if the file changed, check md5sum
-	qint64 file_last_changed = finfo.lastModified().toUTC().toMSecsSinceEpoch();
-	if (file_last_changed != entry->local_changed_timestamp)
-	{
-		QFile input(real_path);
-		input.open(QIODevice::ReadOnly);
-		QString md5sum = QCryptographicHash::hash(input.readAll(), QCryptographicHash::Md5)
-							 .toHex()
-							 .constData();
-		if (entry->md5sum != md5sum)
-		{
-			selected_base.entry_list.remove(resource_path);
-			return staleEntry(base, resource_path);
-		}
-		// md5sums matched... keep entry and save the new state to file
-		entry->local_changed_timestamp = file_last_changed;
+	if (fileMd5(real_path) != entry.md5sum)
+		return File_Changed;
+	return File_Touched;
+}
+
+MetaEntryPtr HttpMetaCache::applyFileState(MetaEntryPtr entry, FileState state,
+										   const MetaEntry &current)
+{
+	switch (state)
+	{
+	case File_Unchanged:
+		break;
+	case File_Touched:
+		// contents matched... keep entry and save the new state to file
+		entry->local_changed_timestamp = current.local_changed_timestamp;
+		entry->local_size = current.local_size;
+		entry->local_inode = current.local_inode;
+		writeJournal(Journal_Put, entry);
 		SaveEventually();
+		break;
+	case File_Missing:
+	case File_Changed:
+		// if the file doesn't exist or is different, we disown the entry
+		removeEntry(entry->base, entry->path);
+		return staleEntry(entry->base, entry->path);
 	}
-
 	// entry passed all the checks we cared about.
 	return entry;
 }
 
+QString HttpMetaCache::fileMd5(QString path)
+{
+	QFile input(path);
+	if (!input.open(QIODevice::ReadOnly))
+		return QString();
+	QCryptographicHash hash(QCryptographicHash::Md5);
+	char buf[65536];
+	qint64 count;
+	while ((count = input.read(buf, sizeof(buf))) > 0)
+		hash.addData(buf, count);
+	if (count < 0)
+		return QString();
+	return hash.result().toHex().constData();
+}
+
 bool HttpMetaCache::updateEntry(MetaEntryPtr stale_entry)
 {
 	if (!m_entries.contains(stale_entry->base))
@@ -130,11 +412,27 @@ bool HttpMetaCache::updateEntry(MetaEntryPtr stale_entry)
 		QLOG_ERROR() << "Cannot add stale entry: " << stale_entry->getFullPath().toLocal8Bit();
 		return false;
 	}
+	// remember what the file looks like now, so we don't have to hash it again later
+	QString real_path = PathCombine(m_entries[stale_entry->base].base_path, stale_entry->path);
+	QFileInfo finfo(real_path);
+	if (finfo.isFile())
+	{
+		stale_entry->local_size = finfo.size();
+		stale_entry->local_inode = fileInode(real_path);
+	}
 	m_entries[stale_entry->base].entry_list[stale_entry->path] = stale_entry;
+	writeJournal(Journal_Put, stale_entry);
 	SaveEventually();
 	return true;
 }
 
+void HttpMetaCache::removeEntry(QString base, QString resource_path)
+{
+	m_entries[base].entry_list[resource_path] = MetaEntryPtr();
+	writeJournal(Journal_Remove, staleEntry(base, resource_path));
+	SaveEventually();
+}
+
 MetaEntryPtr HttpMetaCache::staleEntry(QString base, QString resource_path)
 {
 	auto foo = new MetaEntry;
@@ -144,6 +442,38 @@ MetaEntryPtr HttpMetaCache::staleEntry(QString base, QString resource_path)
 	return MetaEntryPtr(foo);
 }
 
+MetaEntryPtr HttpMetaCache::snapshotEntry(QString base, QString resource_path)
+{
+	if (!m_snapshot_data)
+		return MetaEntryPtr();
+
+	QByteArray key = entryKey(base.toUtf8(), resource_path.toUtf8());
+	const uchar *end = m_snapshot_data + m_snapshot_size;
+	const uchar *index = m_snapshot_data + snapshot_header_size;
+
+	// binary search over the sorted record index
+	quint32 low = 0, high = m_snapshot_count;
+	while (low < high)
+	{
+		quint32 mid = low + (high - low) / 2;
+		quint32 offset = qFromLittleEndian<quint32>(index + mid * 4);
+		QByteArray mid_key;
+		if (offset >= m_snapshot_size || !readKey(m_snapshot_data + offset, end, mid_key))
+		{
+			QLOG_ERROR() << "Metacache snapshot is corrupted, ignoring it.";
+			unmapSnapshot();
+			return MetaEntryPtr();
+		}
+		if (mid_key < key)
+			low = mid + 1;
+		else if (key < mid_key)
+			high = mid;
+		else
+			return deserializeEntry(m_snapshot_data + offset, end);
+	}
+	return MetaEntryPtr();
+}
+
 void HttpMetaCache::addBase(QString base, QString base_root)
 {
 	// TODO: report error
@@ -164,32 +494,148 @@ QString HttpMetaCache::getBasePath(QString base)
 	return QString();
 }
 
+void HttpMetaCache::writeJournal(char op, MetaEntryPtr entry)
+{
+	if (!m_journal.isOpen())
+		return;
+	QByteArray payload = serializeEntry(*entry);
+	QByteArray frame(5, '\0');
+	qToLittleEndian<quint32>(payload.size() + 1, (uchar *)frame.data());
+	frame[4] = op;
+	frame.append(payload);
+	if (m_journal.write(frame) != frame.size())
+	{
+		QLOG_ERROR() << "Failed to write into the metacache journal";
+	}
+	m_journal.flush();
+	m_journal_records++;
+}
+
+int HttpMetaCache::replayJournal(QString path)
+{
+	QFile journal(path);
+	if (!journal.open(QIODevice::ReadOnly))
+		return 0;
+	QByteArray data = journal.readAll();
+	const uchar *pos = (const uchar *)data.constData();
+	const uchar *end = pos + data.size();
+	int records = 0;
+	// a torn write at the end of the journal is simply ignored
+	while (end - pos >= 5)
+	{
+		quint32 length = qFromLittleEndian<quint32>(pos);
+		if (length < 1 || quint32(end - pos - 4) < length)
+			break;
+		char op = pos[4];
+		auto entry = deserializeEntry(pos + 5, pos + 4 + length);
+		pos += 4 + length;
+		if (!entry)
+			break;
+		records++;
+		if (!m_entries.contains(entry->base))
+			continue;
+		auto &entrymap = m_entries[entry->base];
+		if (op == Journal_Put)
+			entrymap.entry_list[entry->path] = entry;
+		else if (op == Journal_Remove)
+			entrymap.entry_list[entry->path] = MetaEntryPtr();
+	}
+	return records;
+}
+
+bool HttpMetaCache::mapSnapshot()
+{
+	m_snapshot.setFileName(m_index_file + ".idx");
+	if (!m_snapshot.open(QIODevice::ReadOnly))
+		return false;
+	qint64 size = m_snapshot.size();
+	uchar *data = size ? m_snapshot.map(0, size) : nullptr;
+	quint32 count = 0;
+	if (!data || !checkSnapshotHeader(data, size, count))
+	{
+		QLOG_ERROR() << "Metacache snapshot is invalid, ignoring it.";
+		if (data)
+			m_snapshot.unmap(data);
+		m_snapshot.close();
+		return false;
+	}
+	m_snapshot_data = data;
+	m_snapshot_size = size;
+	m_snapshot_count = count;
+	return true;
+}
+
+void HttpMetaCache::unmapSnapshot()
+{
+	if (m_snapshot_data)
+		m_snapshot.unmap(m_snapshot_data);
+	m_snapshot.close();
+	m_snapshot_data = nullptr;
+	m_snapshot_size = 0;
+	m_snapshot_count = 0;
+}
+
 void HttpMetaCache::Load()
+{
+	QString snapshot = m_index_file + ".idx";
+	QString journal = m_index_file + ".journal";
+
+	// a compaction may have been interrupted right before the new snapshot got moved in place
+	if (QFile::exists(snapshot + ".new"))
+	{
+		if (!QFile::exists(snapshot))
+			QFile::rename(snapshot + ".new", snapshot);
+		else
+			QFile::remove(snapshot + ".new");
+	}
+
+	if (!mapSnapshot())
+	{
+		// no snapshot yet. pick up the old index, if there is one.
+		m_migrating = loadLegacyIndex();
+	}
+
+	// everything that changed since the snapshot was written
+	m_journal_records = replayJournal(journal + ".old");
+	m_journal_records += replayJournal(journal);
+
+	m_journal.setFileName(journal);
+	if (!m_journal.open(QIODevice::WriteOnly | QIODevice::Append))
+	{
+		QLOG_ERROR() << "Can't open the metacache journal. Cache changes will not be saved.";
+	}
+	if (m_migrating)
+	{
+		startCompaction();
+	}
+}
+
+bool HttpMetaCache::loadLegacyIndex()
 {
 	QFile index(m_index_file);
 	if (!index.open(QIODevice::ReadOnly))
-		return;
+		return false;
 
 	QJsonDocument json = QJsonDocument::fromJson(index.readAll());
 	if (!json.isObject())
-		return;
+		return false;
 	auto root = json.object();
 	// check file version first
 	auto version_val = root.value("version");
 	if (!version_val.isString())
-		return;
+		return false;
 	if (version_val.toString() != "1")
-		return;
+		return false;
 
 	// read the entry array
 	auto entries_val = root.value("entries");
 	if (!entries_val.isArray())
-		return;
+		return false;
 	QJsonArray array = entries_val.toArray();
 	for (auto element : array)
 	{
 		if (!element.isObject())
-			return;
+			return true;
 		auto element_obj = element.toObject();
 		QString base = element_obj.value("base").toString();
 		if (!m_entries.contains(base))
@@ -207,6 +653,7 @@ void HttpMetaCache::Load()
 		foo->stale = false;
 		entrymap.entry_list[path] = MetaEntryPtr(foo);
 	}
+	return true;
 }
 
 void HttpMetaCache::SaveEventually()
@@ -218,36 +665,104 @@ void HttpMetaCache::SaveEventually()
 
 void HttpMetaCache::SaveNow()
 {
-	QSaveFile tfile(m_index_file);
-	if (!tfile.open(QIODevice::WriteOnly | QIODevice::Truncate))
+	// compact once the journal is a sizable fraction of the snapshot
+	int threshold = std::max<quint32>(1024, m_snapshot_count / 4);
+	if (m_migrating || m_journal_records > threshold)
+	{
+		startCompaction();
+	}
+}
+
+void HttpMetaCache::startCompaction()
+{
+	if (m_compactor)
+	{
+		m_compact_again = true;
 		return;
-	QJsonObject toplevel;
-	toplevel.insert("version", QJsonValue(QString("1")));
-	QJsonArray entriesArr;
-	for (auto group : m_entries)
+	}
+	QString journal = m_index_file + ".journal";
+	QString old_journal = journal + ".old";
+
+	// everything journaled so far goes into the new snapshot. later changes go to a fresh journal.
+	m_journal.close();
+	if (QFile::exists(old_journal))
 	{
-		for (auto entry : group.entry_list)
+		// a previous compaction failed. keep its journal around and add to it
+		QFile current(journal);
+		QFile old(old_journal);
+		if (current.open(QIODevice::ReadOnly) &&
+			old.open(QIODevice::WriteOnly | QIODevice::Append))
 		{
-			QJsonObject entryObj;
-			entryObj.insert("base", QJsonValue(entry->base));
-			entryObj.insert("path", QJsonValue(entry->path));
-			entryObj.insert("md5sum", QJsonValue(entry->md5sum));
-			entryObj.insert("etag", QJsonValue(entry->etag));
-			entryObj.insert("last_changed_timestamp",
-							QJsonValue(double(entry->local_changed_timestamp)));
-			if (!entry->remote_changed_timestamp.isEmpty())
-				entryObj.insert("remote_changed_timestamp",
-								QJsonValue(entry->remote_changed_timestamp));
-			entriesArr.append(entryObj);
+			old.write(current.readAll());
+			old.close();
+			current.close();
+			current.remove();
 		}
 	}
-	toplevel.insert("entries", entriesArr);
-	QJsonDocument doc(toplevel);
-	QByteArray jsonData = doc.toJson();
-	qint64 result = tfile.write(jsonData);
-	if (result == -1)
-		return;
-	if (result != jsonData.size())
+	else
+	{
+		QFile::rename(journal, old_journal);
+	}
+	m_journal_records = 0;
+	if (!m_journal.open(QIODevice::WriteOnly | QIODevice::Append))
+	{
+		QLOG_ERROR() << "Can't open the metacache journal. Cache changes will not be saved.";
+	}
+
+	m_compactor = new MetaCacheCompactor();
+	m_compactor->m_old_snapshot = m_snapshot_data ? m_snapshot.fileName() : QString();
+	m_compactor->m_new_snapshot = m_index_file + ".idx.new";
+	for (auto group = m_entries.begin(); group != m_entries.end(); group++)
+	{
+		QByteArray base = group.key().toUtf8();
+		auto &entry_list = group.value().entry_list;
+		for (auto iter = entry_list.begin(); iter != entry_list.end(); iter++)
+		{
+			// removed entries are not written, but still hide the old snapshot record
+			QByteArray key = entryKey(base, iter.key().toUtf8());
+			m_compactor->m_overridden.insert(key);
+			if (iter.value())
+				m_compactor->m_changed.append(qMakePair(key, serializeEntry(*iter.value())));
+		}
+	}
+	connect(m_compactor, SIGNAL(finished()), SLOT(compactionFinished()));
+	m_compactor->start(QThread::LowPriority);
+}
+
+void HttpMetaCache::compactionFinished()
+{
+	if (!m_compactor)
 		return;
-	tfile.commit();
+	auto compactor = m_compactor;
+	m_compactor = nullptr;
+	compactor->wait();
+	bool success = compactor->m_success;
+	delete compactor;
+
+	if (success)
+	{
+		QString snapshot = m_index_file + ".idx";
+		unmapSnapshot();
+		QFile::remove(snapshot);
+		if (QFile::rename(snapshot + ".new", snapshot))
+		{
+			QFile::remove(m_index_file + ".journal.old");
+			if (m_migrating)
+			{
+				QFile::remove(m_index_file);
+				m_migrating = false;
+			}
+		}
+		mapSnapshot();
+	}
+	else
+	{
+		QLOG_ERROR() << "Failed to compact the metacache journal.";
+	}
+
+	if (m_compact_again)
+	{
+		m_compact_again = false;
+		startCompaction();
+	}
 }
@@ -16,7 +16,9 @@
 #pragma once
 #include <QString>
 #include <QMap>
+#include <QFile>
 #include <qtimer.h>
+#include <memory>
 
 struct MetaEntry
 {
@@ -26,12 +28,23 @@ struct MetaEntry
 	QString etag;
 	qint64 local_changed_timestamp = 0;
 	QString remote_changed_timestamp; // QString for now, RFC 2822 encoded time
+	// size and inode of the local file when it was last verified. -1 / 0 when unknown
+	qint64 local_size = -1;
+	quint64 local_inode = 0;
 	bool stale = true;
 	QString getFullPath();
 };
 
 typedef std::shared_ptr<MetaEntry> MetaEntryPtr;
 
+class MetaCacheCompactor;
+
+/*
+ * The cache index is kept on disk as a sorted binary snapshot (<index>.idx) that is
+ * memory-mapped and searched on demand, and an append-only journal (<index>.journal) of
+ * every change made since the snapshot was written. Once the journal grows big enough,
+ * a background thread merges both into a new snapshot.
+ */
 class HttpMetaCache : public QObject
 {
 	Q_OBJECT
@@ -53,23 +66,69 @@ public:
 
 	void addBase(QString base, QString base_root);
 
+	enum FileState
+	{
+		File_Missing,   // the file is gone or unreadable
+		File_Unchanged, // size, time and inode match the entry
+		File_Touched,   // the file is fine, but the entry needs the new size/time/inode
+		File_Changed	// the contents don't match the entry
+	};
+	// look at the file behind an entry. only hashes the file if the cheap checks don't
+	// settle it. doesn't touch the cache, so this can be called from any thread.
+	// the stamp of the file is written into 'current'.
+	static FileState checkFile(QString real_path, const MetaEntry &entry, MetaEntry &current);
+	// apply the result of checkFile to a cached entry. returns either it, or a stale entry.
+	MetaEntryPtr applyFileState(MetaEntryPtr entry, FileState state, const MetaEntry &current);
+	// md5 of a file, read in small pieces. empty if it can't be read.
+	static QString fileMd5(QString path);
+
 	// (re)start a timer that calls SaveNow later.
 	void SaveEventually();
 	void Load();
 	QString getBasePath(QString base);
 public
 slots:
+	// compact the journal into a new snapshot, if it's worth it
 	void SaveNow();
 
+private
+slots:
+	void compactionFinished();
+
 private:
 	// create a new stale entry, given the parameters
 	MetaEntryPtr staleEntry(QString base, QString resource_path);
+	// look up an entry in the mapped snapshot
+	MetaEntryPtr snapshotEntry(QString base, QString resource_path);
+	// drop an entry from the cache
+	void removeEntry(QString base, QString resource_path);
+
+	void writeJournal(char op, MetaEntryPtr entry);
+	int replayJournal(QString path);
+	bool loadLegacyIndex();
+	bool mapSnapshot();
+	void unmapSnapshot();
+	void startCompaction();
+
 	struct EntryMap
 	{
 		QString base_path;
+		// entries read or changed since startup. a null entry means it was removed.
 		QMap<QString, MetaEntryPtr> entry_list;
 	};
 	QMap<QString, EntryMap> m_entries;
 	QString m_index_file;
 	QTimer saveBatchingTimer;
-};
\ No newline at end of file
+
+	QFile m_snapshot;
+	uchar *m_snapshot_data = nullptr;
+	qint64 m_snapshot_size = 0;
+	quint32 m_snapshot_count = 0;
+
+	QFile m_journal;
+	int m_journal_records = 0;
+
+	MetaCacheCompactor *m_compactor = nullptr;
+	bool m_compact_again = false;
+	bool m_migrating = false;
+};
@@ -0,0 +1,137 @@
+/* Copyright 2013 MultiMC Contributors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "MultiMC.h"
+#include "MetaCacheValidator.h"
+#include <pathutils.h>
+
+#include <QRunnable>
+#include "logger/QsLog.h"
+
+/*
+ * Checks a slice of the batch. The slices don't overlap, so no locking is needed.
+ */
+class FileCheckRunner : public QRunnable
+{
+public:
+	FileCheckRunner(MetaCacheValidator *owner, MetaCacheValidator::FileCheck *begin,
+					MetaCacheValidator::FileCheck *end, QAtomicInt *chunks_left)
+		: m_owner(owner), m_begin(begin), m_end(end), m_chunks_left(chunks_left)
+	{
+	}
+	void run()
+	{
+		for (auto check = m_begin; check != m_end; check++)
+		{
+			check->state = HttpMetaCache::checkFile(check->real_path, check->cached,
+													check->current);
+		}
+		// the last one out reports back
+		if (!m_chunks_left->deref())
+			QMetaObject::invokeMethod(m_owner, "checksDone", Qt::QueuedConnection);
+	}
+
+private:
+	MetaCacheValidator *m_owner;
+	MetaCacheValidator::FileCheck *m_begin;
+	MetaCacheValidator::FileCheck *m_end;
+	QAtomicInt *m_chunks_left;
+};
+
+MetaCacheValidator::MetaCacheValidator(QString base) : QObject(), m_base(base)
+{
+}
+
+MetaCacheValidator::~MetaCacheValidator()
+{
+	// the workers write into m_checks
+	m_pool.waitForDone();
+}
+
+int MetaCacheValidator::addEntry(QString resource_path, QString expected_etag)
+{
+	m_requests.append(qMakePair(resource_path, expected_etag));
+	return m_requests.size() - 1;
+}
+
+void MetaCacheValidator::start()
+{
+	auto metacache = MMC->metacache();
+	QString base_path = metacache->getBasePath(m_base);
+
+	// the cheap part: look the entries up and hand the files over to the workers
+	m_resolved.clear();
+	m_checks.clear();
+	for (int i = 0; i < m_requests.size(); i++)
+	{
+		auto &request = m_requests[i];
+		auto entry = metacache->getEntry(m_base, request.first);
+		if (entry && (request.second.isEmpty() || request.second == entry->etag))
+		{
+			FileCheck check;
+			check.index = i;
+			check.real_path = PathCombine(base_path, request.first);
+			check.cached = *entry;
+			m_checks.append(check);
+		}
+		else
+		{
+			// missing or with the wrong etag. resolveEntry knows what to do with those.
+			entry = metacache->resolveEntry(m_base, request.first, request.second);
+		}
+		m_resolved.append(entry);
+	}
+
+	if (m_checks.isEmpty())
+	{
+		QMetaObject::invokeMethod(this, "checksDone", Qt::QueuedConnection);
+		return;
+	}
+
+	// a few slices per thread, so one slow disk region doesn't hold everything up
+	int slices = qMin(m_checks.size(), qMax(1, m_pool.maxThreadCount()) * 4);
+	int per_slice = (m_checks.size() + slices - 1) / slices;
+	slices = (m_checks.size() + per_slice - 1) / per_slice;
+	m_chunks_left.store(slices);
+	FileCheck *data = m_checks.data();
+	for (int begin = 0; begin < m_checks.size(); begin += per_slice)
+	{
+		int end = qMin(begin + per_slice, m_checks.size());
+		m_pool.start(new FileCheckRunner(this, data + begin, data + end, &m_chunks_left));
+	}
+}
+
+void MetaCacheValidator::checksDone()
+{
+	auto metacache = MMC->metacache();
+	for (auto &check : m_checks)
+	{
+		auto entry = m_resolved[check.index];
+		m_resolved[check.index] = metacache->applyFileState(entry, check.state, check.current);
+	}
+	m_checks.clear();
+	emit finished();
+}
+
+QList<MetaEntryPtr> MetaCacheValidator::staleEntries() const
+{
+	QList<MetaEntryPtr> stale;
+	for (auto entry : m_resolved)
+	{
+		if (entry->stale)
+			stale.append(entry);
+	}
+	return stale;
+}
@@ -0,0 +1,77 @@
+/* Copyright 2013 MultiMC Contributors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <QObject>
+#include <QThreadPool>
+#include <QVector>
+#include <QAtomicInt>
+#include "HttpMetaCache.h"
+
+typedef std::shared_ptr<class MetaCacheValidator> MetaCacheValidatorPtr;
+
+/*
+ * Resolves a whole batch of cache entries from one base, like HttpMetaCache::resolveEntry.
+ * Looking at the files (and hashing them, if needed) happens on a thread pool.
+ * Everything that touches the cache itself stays on the thread that owns this object.
+ */
+class MetaCacheValidator : public QObject
+{
+	Q_OBJECT
+public:
+	explicit MetaCacheValidator(QString base);
+	~MetaCacheValidator();
+
+	/// add an entry to the batch. returns its index in entries()
+	int addEntry(QString resource_path, QString expected_etag = QString());
+
+	/// start validating. finished() is emitted when done, even if there was nothing to do
+	void start();
+
+	/// the resolved entries, in the order they were added. valid after finished()
+	QList<MetaEntryPtr> entries() const
+	{
+		return m_resolved;
+	}
+	/// the entries that turned out to be stale. valid after finished()
+	QList<MetaEntryPtr> staleEntries() const;
+
+signals:
+	void finished();
+
+private
+slots:
+	void checksDone();
+
+public:
+	/// one file to look at
+	struct FileCheck
+	{
+		int index;
+		QString real_path;
+		MetaEntry cached;
+		MetaEntry current;
+		HttpMetaCache::FileState state;
+	};
+
+private:
+	QString m_base;
+	QList<QPair<QString, QString>> m_requests;
+	QList<MetaEntryPtr> m_resolved;
+	QVector<FileCheck> m_checks;
+	QAtomicInt m_chunks_left;
+	QThreadPool m_pool;
+};
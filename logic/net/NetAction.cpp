@@ -0,0 +1,245 @@
+/* Copyright 2013 MultiMC Contributors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "NetAction.h"
+#include "FileSink.h"
+#include <QHash>
+#include <QDateTime>
+#include <QTimer>
+#include <QFile>
+#include <algorithm>
+#include "logger/QsLog.h"
+
+// the actions currently downloading something, by resource key. only used from one thread.
+static QHash<QString, NetAction *> s_in_flight;
+
+// how much a reply may buffer before TCP pushes back on the server
+const qint64 throttled_buffer_size = 256 * 1024;
+// how often throttled downloads look for more tokens
+const int throttled_read_interval = 50;
+
+NetAction::~NetAction()
+{
+	stopFollowing();
+	releaseDownload();
+}
+
+bool NetAction::followRunningDownload(QString key)
+{
+	stopFollowing();
+	auto iter = s_in_flight.find(key);
+	if (iter != s_in_flight.end() && *iter != this && (*iter)->m_status == Job_Finished)
+	{
+		// it just finished and is telling everyone right now. we're too late to hear it.
+		QMetaObject::invokeMethod(this, "leaderSucceeded", Qt::QueuedConnection, Q_ARG(int, 0));
+		return true;
+	}
+	if (iter != s_in_flight.end() && *iter != this && (*iter)->m_status == Job_InProgress)
+	{
+		m_leader = *iter;
+		QLOG_INFO() << "Already downloading" << key << "- waiting for that instead";
+		connect(m_leader, SIGNAL(succeeded(int)), SLOT(leaderSucceeded(int)));
+		connect(m_leader, SIGNAL(failed(int)), SLOT(leaderFailed(int)));
+		connect(m_leader, SIGNAL(progress(int, qint64, qint64)),
+				SLOT(leaderProgress(int, qint64, qint64)));
+		connect(m_leader, SIGNAL(destroyed()), SLOT(leaderDestroyed()));
+		return true;
+	}
+	if (m_inflight_key != key)
+		releaseDownload();
+	m_inflight_key = key;
+	s_in_flight[key] = this;
+	// give up the key before anyone waiting on us hears about the result
+	connect(this, SIGNAL(succeeded(int)), SLOT(resultReported()), Qt::UniqueConnection);
+	connect(this, SIGNAL(failed(int)), SLOT(resultReported()), Qt::UniqueConnection);
+	return false;
+}
+
+void NetAction::resultReported()
+{
+	// our job may have restarted us already, in which case we're still on it
+	if (m_status == Job_InProgress)
+		return;
+	releaseDownload();
+}
+
+void NetAction::releaseDownload()
+{
+	if (m_inflight_key.isEmpty())
+		return;
+	auto iter = s_in_flight.find(m_inflight_key);
+	if (iter != s_in_flight.end() && *iter == this)
+		s_in_flight.erase(iter);
+	m_inflight_key.clear();
+}
+
+void NetAction::stopFollowing()
+{
+	if (!m_leader)
+		return;
+	disconnect(m_leader, 0, this, 0);
+	m_leader = nullptr;
+}
+
+void NetAction::leaderFinished(bool)
+{
+	start();
+}
+
+void NetAction::leaderSucceeded(int)
+{
+	stopFollowing();
+	leaderFinished(true);
+}
+
+void NetAction::leaderFailed(int)
+{
+	stopFollowing();
+	leaderFinished(false);
+}
+
+void NetAction::leaderDestroyed()
+{
+	// the leader's job went away without finishing. we're on our own.
+	m_leader = nullptr;
+	leaderFinished(false);
+}
+
+void NetAction::leaderProgress(int, qint64 current, qint64 total)
+{
+	emit progress(index_within_job, current, total);
+}
+
+void NetAction::watchReply(QNetworkReply *reply)
+{
+	m_http_status = 0;
+	m_response_time = -1;
+	m_error = QNetworkReply::NoError;
+	m_retry_after = -1;
+	connect(reply, SIGNAL(metaDataChanged()), SLOT(replyMetaDataChanged()));
+	connect(reply, SIGNAL(error(QNetworkReply::NetworkError)),
+			SLOT(replyError(QNetworkReply::NetworkError)));
+}
+
+void NetAction::throttleReply(QNetworkReply *reply)
+{
+	m_finish_pending = false;
+	// the caps or the disk may hold the data back at any time. it must wait in the socket,
+	// not pile up in memory
+	reply->setReadBufferSize(throttled_buffer_size);
+}
+
+QByteArray NetAction::readThrottled(QNetworkReply *reply, FileSink *output)
+{
+	qint64 allowed = BandwidthLimiter::allowance(m_job_limiter.get(), m_background);
+	// the disk can't keep up. slow the server down instead of eating all the memory
+	if (output && output->isBusy())
+		allowed = 0;
+	QByteArray data;
+	if (allowed < 0)
+		data = reply->readAll();
+	else
+		data = reply->read(std::min(allowed, reply->bytesAvailable()));
+	BandwidthLimiter::charge(m_job_limiter.get(), m_background, data.size());
+	if (reply->bytesAvailable() > 0 && !m_read_scheduled)
+	{
+		m_read_scheduled = true;
+		QTimer::singleShot(throttled_read_interval, this, SLOT(readMore()));
+	}
+	return data;
+}
+
+bool NetAction::finishLater(QNetworkReply *reply)
+{
+	if (m_status == Job_Failed || reply->bytesAvailable() == 0)
+	{
+		m_finish_pending = false;
+		return false;
+	}
+	m_finish_pending = true;
+	if (!m_read_scheduled)
+	{
+		m_read_scheduled = true;
+		QTimer::singleShot(throttled_read_interval, this, SLOT(readMore()));
+	}
+	return true;
+}
+
+QByteArray NetAction::loadPartValidator(QString part_path)
+{
+	QFile file(part_path + ".validator");
+	if (!file.open(QIODevice::ReadOnly))
+		return QByteArray();
+	return file.readAll().trimmed();
+}
+
+void NetAction::savePartValidator(QString part_path, QByteArray validator)
+{
+	QFile file(part_path + ".validator");
+	if (validator.isEmpty())
+	{
+		file.remove();
+		return;
+	}
+	if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate) || file.write(validator) < 0)
+		QLOG_ERROR() << "Can't save" << file.fileName();
+}
+
+void NetAction::readMore()
+{
+	m_read_scheduled = false;
+	if (!m_reply)
+		return;
+	if (m_status == Job_InProgress && m_reply->bytesAvailable() > 0)
+		downloadReadyRead();
+	// the reply may be gone after this, if the download failed while reading
+	if (m_reply && m_finish_pending && !finishLater(m_reply.get()))
+		downloadFinished();
+}
+
+void NetAction::replyError(QNetworkReply::NetworkError error)
+{
+	m_error = error;
+}
+
+void NetAction::replyMetaDataChanged()
+{
+	QNetworkReply *reply = qobject_cast<QNetworkReply *>(sender());
+	if (!reply)
+		return;
+	if (m_response_time < 0)
+		m_response_time = QDateTime::currentMSecsSinceEpoch();
+	int status = reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+	if (status)
+		m_http_status = status;
+	if (reply->hasRawHeader("Retry-After"))
+	{
+		// either a number of seconds or a date
+		QByteArray value = reply->rawHeader("Retry-After").trimmed();
+		bool ok = false;
+		qint64 seconds = value.toLongLong(&ok);
+		if (ok)
+		{
+			m_retry_after = std::max<qint64>(seconds, 0) * 1000;
+		}
+		else
+		{
+			QDateTime when = QDateTime::fromString(QString::fromLatin1(value), Qt::RFC2822Date);
+			qint64 now = QDateTime::currentMSecsSinceEpoch();
+			if (when.isValid())
+				m_retry_after = std::max<qint64>(when.toMSecsSinceEpoch() - now, 0);
+		}
+	}
+}
@@ -19,6 +19,8 @@
 #include <QUrl>
 #include <memory>
 #include <QNetworkReply>
+#include <QThreadPool>
+#include "BandwidthLimiter.h"
 
 enum JobStatus
 {
@@ -28,6 +30,8 @@ enum JobStatus
 	Job_Failed
 };
 
+class FileSink;
+
 typedef std::shared_ptr<class NetAction> NetActionPtr;
 class NetAction : public QObject
 {
@@ -36,7 +40,26 @@ protected:
 	explicit NetAction() : QObject(0) {};
 
 public:
-	virtual ~NetAction() {};
+	virtual ~NetAction();
+
+	/// shared pool for the CPU heavy parts of network actions (decompressing, unpacking, ...)
+	static QThreadPool *workerPool()
+	{
+		static QThreadPool pool;
+		return &pool;
+	}
+	/// threads that write downloads to disk, so the network side never waits for it
+	static QThreadPool *ioPool()
+	{
+		static QThreadPool pool;
+		static bool configured = false;
+		if (!configured)
+		{
+			pool.setMaxThreadCount(2);
+			configured = true;
+		}
+		return &pool;
+	}
 
 public:
 	/// the network reply
@@ -51,12 +74,90 @@ public:
 	/// index within the parent job
 	int index_within_job = 0;
 
+	/// scheduling priority within the parent job. higher is started first.
+	int priority = 0;
+
+	/// HTTP status of the last reply, 0 if there was none (or it wasn't HTTP)
+	int m_http_status = 0;
+	/// when the last reply got its headers, in msecs since the epoch. -1 if it didn't
+	qint64 m_response_time = -1;
+	/// network error of the last reply
+	QNetworkReply::NetworkError m_error = QNetworkReply::NoError;
+	/// how long the server asked us to wait (Retry-After) in msecs, -1 if it didn't
+	qint64 m_retry_after = -1;
+
+	/// bandwidth cap of the parent job, if it has one. the global caps always apply
+	BandwidthLimiterPtr m_job_limiter;
+	/// background downloads yield to everything else
+	bool m_background = false;
+
 signals:
 	void started(int index);
 	void progress(int index, qint64 current, qint64 total);
 	void succeeded(int index);
 	void failed(int index);
 
+protected:
+	/**
+	 * Only one action at a time downloads a given resource, across all jobs.
+	 * Call this from start() with a key that identifies the resource (like cache base + path).
+	 * If another action is already downloading it, returns true: this one then waits for that
+	 * one to finish and gets leaderFinished() called instead of downloading anything.
+	 * Otherwise this action owns the key until it succeeds, fails or dies.
+	 */
+	bool followRunningDownload(QString key);
+
+	/// the action we were waiting on finished. the default starts over.
+	virtual void leaderFinished(bool success);
+
+	/// keep track of the HTTP status, errors and response time of 'reply', for NetJob
+	void watchReply(QNetworkReply *reply);
+
+	/**
+	 * Bandwidth shaping and disk backpressure. Call throttleReply() right after starting the
+	 * request, read the data with readThrottled() instead of readAll(), and start
+	 * downloadFinished() with 'if (finishLater(reply)) return;'. Whatever can't be read yet
+	 * stays in the socket and is picked up by downloadReadyRead() a little later.
+	 */
+	void throttleReply(QNetworkReply *reply);
+	/// read as much as the bandwidth caps allow right now. nothing while 'output' is busy
+	QByteArray readThrottled(QNetworkReply *reply, FileSink *output = nullptr);
+	/// true if the reply finished with data we weren't allowed to read yet
+	bool finishLater(QNetworkReply *reply);
+
+	/// the validator (ETag or Last-Modified) of a kept '.part' file. empty if there is none
+	static QByteArray loadPartValidator(QString part_path);
+	/// remember the validator next to the '.part' file, so resuming works after a restart too.
+	/// an empty one is forgotten
+	static void savePartValidator(QString part_path, QByteArray validator);
+
+public:
+	/**
+	 * Switch to another source for the same thing, if there is one, for the next start().
+	 * NetJob uses this to get away from hosts that are down. The default can't.
+	 */
+	virtual bool tryOtherMirror()
+	{
+		return false;
+	}
+
+protected:
+
+	/// give up the key, if we own one
+	void releaseDownload();
+
+protected
+slots:
+	void resultReported();
+	void replyMetaDataChanged();
+	void replyError(QNetworkReply::NetworkError error);
+	void leaderSucceeded(int);
+	void leaderFailed(int);
+	void leaderDestroyed();
+	void leaderProgress(int, qint64 current, qint64 total);
+	/// read what the bandwidth caps held back, and finish if that was all
+	void readMore();
+
 protected
 slots:
 	virtual void downloadProgress(qint64 bytesReceived, qint64 bytesTotal) = 0;
@@ -67,4 +168,17 @@ slots:
 public
 slots:
 	virtual void start() = 0;
+
+private:
+	void stopFollowing();
+
+private:
+	/// the key we own, if any
+	QString m_inflight_key;
+	/// the action we're waiting on, if any
+	NetAction *m_leader = nullptr;
+	/// a throttled read is coming up
+	bool m_read_scheduled = false;
+	/// the reply finished while data was still held back
+	bool m_finish_pending = false;
 };
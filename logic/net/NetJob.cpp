@@ -19,11 +19,36 @@
 #include "FileDownload.h"
 #include "ByteArrayDownload.h"
 #include "CacheDownload.h"
+#include "UrlResolver.h"
 
+#include <settingsobject.h>
 #include "logger/QsLog.h"
+#include <QDateTime>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QJsonArray>
+#include <algorithm>
+
+// how often progress is published, at most. about 30 times a second
+const int progress_interval = 33;
+// how many msecs of history the transfer rate is smoothed over, roughly
+const double rate_smoothing = 1000.0;
+
+NetJob::NetJob(QString job_name) : ProgressProvider(), m_job_name(job_name)
+{
+	m_progress_timer.setSingleShot(true);
+	connect(&m_progress_timer, SIGNAL(timeout()), SLOT(publishProgress()));
+	m_retry_timer.setSingleShot(true);
+	connect(&m_retry_timer, SIGNAL(timeout()), SLOT(retryTimerFired()));
+}
 
 void NetJob::partSucceeded(int index)
 {
+	if (!releasePart(index))
+		return;
+	finishAttempt(index, true);
+	endProbe(index);
+
 	// do progress. all slots are 1 in size at least
 	auto &slot = parts_progress[index];
 	partProgress(index, slot.total_progress, slot.total_progress);
@@ -35,6 +60,7 @@ void NetJob::partSucceeded(int index)
 
 	if (num_failed + num_succeeded == downloads.size())
 	{
+		jobFinished();
 		if (num_failed)
 		{
 			QLOG_ERROR() << m_job_name.toLocal8Bit() << "failed.";
@@ -45,31 +71,87 @@ void NetJob::partSucceeded(int index)
 			QLOG_INFO() << m_job_name.toLocal8Bit() << "succeeded.";
 			emit succeeded();
 		}
+		return;
 	}
+	startMoreParts();
 }
 
 void NetJob::partFailed(int index)
 {
 	auto &slot = parts_progress[index];
-	if (slot.failures == 3)
+	if (!releasePart(index))
+		return;
+	finishAttempt(index, false);
+
+	auto part = downloads[index];
+	auto kind = m_retry_policy->classify(*part);
+	if (kind == RetryPolicy::Failure_Host)
+		HostCircuitBreaker::instance().reportFailure(slot.host, slot.probe);
+	endProbe(index);
+
+	// a mirror that wasn't tried yet gets its chance right away, whatever went wrong here
+	slot.hosts_tried.insert(slot.host);
+	QString next_host = hostOf(part->m_url);
+	if (next_host != slot.host && !slot.hosts_tried.contains(next_host))
 	{
-		QLOG_ERROR() << "Part" << index << "failed 3 times (" << downloads[index]->m_url << ")";
-		num_failed++;
-		emit filesProgress(num_succeeded, num_failed, downloads.size());
-		if (num_failed + num_succeeded == downloads.size())
-		{
-			QLOG_ERROR() << m_job_name.toLocal8Bit() << "failed.";
-			emit failed();
-		}
+		QLOG_ERROR() << "Part" << index << "failed, trying" << next_host << "next ("
+					 << part->m_url << ")";
+		enqueuePart(index);
+		startMoreParts();
+		return;
+	}
+
+	slot.failures++;
+	qint64 delay = m_retry_policy->retryDelay(*part, kind, slot.failures);
+	if (delay < 0)
+	{
+		QLOG_ERROR() << "Part" << index << "failed" << slot.failures << "times, giving up ("
+					 << part->m_url << ")";
+		if (failPart(index))
+			return;
+		startMoreParts();
+		return;
 	}
+
+	// the part moved on to another mirror, so there's no need to wait for this one
+	if (hostOf(part->m_url) != slot.host)
+		delay = 0;
+	QLOG_ERROR() << "Part" << index << "failed, restarting in" << delay << "ms ("
+				 << part->m_url << ")";
+	if (delay)
+		m_delayed.insert(QDateTime::currentMSecsSinceEpoch() + delay, index);
 	else
+		enqueuePart(index);
+	startMoreParts();
+}
+
+bool NetJob::failPart(int index)
+{
+	downloads[index]->m_status = Job_Failed;
+	num_failed++;
+	emit filesProgress(num_succeeded, num_failed, downloads.size());
+	if (num_failed + num_succeeded == downloads.size())
 	{
-		QLOG_ERROR() << "Part" << index << "failed, restarting (" << downloads[index]->m_url
-					 << ")";
-		// restart the job
-		slot.failures++;
-		downloads[index]->start();
+		m_retry_timer.stop();
+		jobFinished();
+		QLOG_ERROR() << m_job_name.toLocal8Bit() << "failed.";
+		emit failed();
+		return true;
 	}
+	return false;
+}
+
+void NetJob::retryTimerFired()
+{
+	qint64 now = QDateTime::currentMSecsSinceEpoch();
+	while (!m_delayed.isEmpty() && m_delayed.firstKey() <= now)
+	{
+		auto iter = m_delayed.begin();
+		int index = iter.value();
+		m_delayed.erase(iter);
+		enqueuePart(index);
+	}
+	startMoreParts();
 }
 
 void NetJob::partProgress(int index, qint64 bytesReceived, qint64 bytesTotal)
@@ -79,25 +161,260 @@ void NetJob::partProgress(int index, qint64 bytesReceived, qint64 bytesTotal)
 	current_progress -= slot.current_progress;
 	slot.current_progress = bytesReceived;
 	current_progress += slot.current_progress;
+	if (slot.attempt >= 0)
+		m_attempts[slot.attempt].bytes = bytesReceived;
 
 	total_progress -= slot.total_progress;
 	slot.total_progress = bytesTotal;
 	total_progress += slot.total_progress;
+	progressChanged();
+}
+
+void NetJob::progressChanged()
+{
+	m_progress_dirty = true;
+	if (!m_progress_timer.isActive())
+		m_progress_timer.start(progress_interval);
+}
+
+void NetJob::publishProgress()
+{
+	m_progress_timer.stop();
+	if (!m_progress_dirty)
+		return;
+	m_progress_dirty = false;
+
+	if (m_rate_clock.isValid())
+	{
+		qint64 now = m_rate_clock.elapsed();
+		qint64 elapsed = now - m_rate_last_time;
+		if (elapsed > 0)
+		{
+			// retries can take progress back. that isn't negative speed
+			qint64 transferred = std::max<qint64>(current_progress - m_rate_last_progress, 0);
+			double rate = transferred * 1000.0 / elapsed;
+			if (m_rate < 0)
+				m_rate = rate;
+			else
+				m_rate += (rate - m_rate) * (elapsed / (elapsed + rate_smoothing));
+			m_rate_last_time = now;
+			m_rate_last_progress = current_progress;
+		}
+	}
 	emit progress(current_progress, total_progress);
+	emit transferRate(bytesPerSecond(), eta());
+}
+
+qint64 NetJob::eta() const
+{
+	if (total_progress <= current_progress)
+		return 0;
+	if (m_rate <= 0)
+		return -1;
+	return qint64((total_progress - current_progress) * 1000.0 / m_rate);
+}
+
+void NetJob::setBandwidthLimit(int kib_per_second)
+{
+	if (kib_per_second > 0)
+		m_limiter = std::make_shared<BandwidthLimiter>(qint64(kib_per_second) * 1024);
+	else
+		m_limiter.reset();
 }
 
 void NetJob::start()
 {
 	QLOG_INFO() << m_job_name.toLocal8Bit() << " started.";
 	m_running = true;
+	m_rate_clock.start();
+	m_rate_last_time = 0;
+	m_rate_last_progress = current_progress;
+	m_rate = -1;
+	BandwidthLimiter::applySettings();
+	if (m_max_in_flight <= 0)
+		m_max_in_flight = MMC->settings()->get("NetMaxInFlight").toInt();
+	if (m_max_in_flight_per_host <= 0)
+		m_max_in_flight_per_host = MMC->settings()->get("NetMaxInFlightPerHost").toInt();
 	for (auto iter : downloads)
 	{
-		connect(iter.get(), SIGNAL(succeeded(int)), SLOT(partSucceeded(int)));
-		connect(iter.get(), SIGNAL(failed(int)), SLOT(partFailed(int)));
-		connect(iter.get(), SIGNAL(progress(int, qint64, qint64)),
-				SLOT(partProgress(int, qint64, qint64)));
-		iter->start();
+		connectPart(iter.get());
+		enqueuePart(iter->index_within_job);
+	}
+	startMoreParts();
+}
+
+void NetJob::connectPart(NetAction *part)
+{
+	part->m_job_limiter = m_limiter;
+	part->m_background = m_background;
+	connect(part, SIGNAL(succeeded(int)), SLOT(partSucceeded(int)));
+	connect(part, SIGNAL(failed(int)), SLOT(partFailed(int)));
+	connect(part, SIGNAL(progress(int, qint64, qint64)),
+			SLOT(partProgress(int, qint64, qint64)));
+}
+
+QString NetJob::hostOf(const QUrl &url)
+{
+	// the request goes wherever the rewrite rules send it, and that's the host that counts
+	auto resolver = MMC->urlResolver();
+	if (resolver)
+		return resolver->resolve(url).host();
+	return url.host();
+}
+
+void NetJob::enqueuePart(int index)
+{
+	auto &slot = parts_progress[index];
+	slot.host = hostOf(downloads[index]->m_url);
+	slot.queue_order = m_queue_counter++;
+	slot.queued_time = QDateTime::currentMSecsSinceEpoch();
+
+	// insert behind everything with the same or higher priority
+	int priority = downloads[index]->priority;
+	auto &queue = m_ready[slot.host];
+	int pos = queue.size();
+	while (pos > 0 && downloads[queue[pos - 1]]->priority < priority)
+		pos--;
+	queue.insert(pos, index);
+}
+
+bool NetJob::releasePart(int index)
+{
+	auto &slot = parts_progress[index];
+	// parts can report failure more than once. only the first report counts.
+	if (!slot.in_flight)
+		return false;
+	slot.in_flight = false;
+	m_in_flight--;
+	m_host_load[slot.host]--;
+	return true;
+}
+
+void NetJob::startMoreParts()
+{
+	// starting a part can make it finish right away, which calls back into this.
+	// the outer call will pick up whatever slot got freed.
+	if (m_scheduling)
+		return;
+
+	auto &breaker = HostCircuitBreaker::instance();
+	QList<int> dead;
+	for (auto host : m_ready.keys())
+	{
+		if (!m_ready[host].isEmpty() && breaker.isOpen(host))
+			failOverFrom(host, dead);
+	}
+	for (int index : dead)
+	{
+		QLOG_ERROR() << "Part" << index << "not started, its host is down ("
+					 << downloads[index]->m_url << ")";
+		if (failPart(index))
+			return;
+	}
+
+	m_scheduling = true;
+	while (m_max_in_flight <= 0 || m_in_flight < m_max_in_flight)
+	{
+		// pick the best head of all the hosts that still have room
+		int best = -1;
+		QString best_host;
+		for (auto iter = m_ready.begin(); iter != m_ready.end(); iter++)
+		{
+			if (iter.value().isEmpty() || breaker.isOpen(iter.key()))
+				continue;
+			if (m_max_in_flight_per_host > 0 &&
+				m_host_load.value(iter.key()) >= m_max_in_flight_per_host)
+				continue;
+			int candidate = iter.value().first();
+			if (best == -1)
+			{
+				best = candidate;
+				best_host = iter.key();
+				continue;
+			}
+			int candidate_priority = downloads[candidate]->priority;
+			int best_priority = downloads[best]->priority;
+			if (candidate_priority > best_priority ||
+				(candidate_priority == best_priority &&
+				 parts_progress[candidate].queue_order < parts_progress[best].queue_order))
+			{
+				best = candidate;
+				best_host = iter.key();
+			}
+		}
+		if (best == -1)
+			break;
+		m_ready[best_host].removeFirst();
+
+		auto &slot = parts_progress[best];
+		slot.in_flight = true;
+		m_in_flight++;
+		m_host_load[best_host]++;
+
+		Attempt attempt;
+		attempt.part = best;
+		attempt.url = downloads[best]->m_url.toString();
+		attempt.queued = slot.queued_time;
+		attempt.started = QDateTime::currentMSecsSinceEpoch();
+		slot.attempt = m_attempts.size();
+		m_attempts.append(attempt);
+
+		slot.probe = breaker.requestStarted(best_host);
+		downloads[best]->start();
+	}
+	m_scheduling = false;
+	armRetryTimer();
+}
+
+void NetJob::failOverFrom(QString host, QList<int> &dead)
+{
+	auto &breaker = HostCircuitBreaker::instance();
+	QList<int> queue = m_ready.take(host);
+	QList<int> keep;
+	for (int index : queue)
+	{
+		auto part = downloads[index];
+		if (part->tryOtherMirror() && hostOf(part->m_url) != host)
+		{
+			QLOG_INFO() << "Part" << index << "moves away from" << host << "to"
+						<< hostOf(part->m_url);
+			enqueuePart(index);
+		}
+		else if (breaker.isDown(host))
+		{
+			dead.append(index);
+		}
+		else
+		{
+			keep.append(index);
+		}
+	}
+	if (!keep.isEmpty())
+		m_ready[host] = keep;
+}
+
+void NetJob::armRetryTimer()
+{
+	auto &breaker = HostCircuitBreaker::instance();
+	qint64 now = QDateTime::currentMSecsSinceEpoch();
+	qint64 next = m_delayed.isEmpty() ? 0 : m_delayed.firstKey();
+	for (auto iter = m_ready.begin(); iter != m_ready.end(); iter++)
+	{
+		if (iter.value().isEmpty() || !breaker.isOpen(iter.key()))
+			continue;
+		qint64 when = breaker.retryTime(iter.key());
+		// someone is probing the host. check back in a while
+		if (!when)
+			when = now + 1000;
+		if (!next || when < next)
+			next = when;
+	}
+	if (!next)
+	{
+		m_retry_timer.stop();
+		return;
 	}
+	m_retry_timer.start(std::max<qint64>(next - now, 0));
 }
 
 QStringList NetJob::getFailedFiles()
@@ -112,3 +429,161 @@ QStringList NetJob::getFailedFiles()
 	}
 	return failed;
 }
+
+void NetJob::finishAttempt(int index, bool success)
+{
+	auto &slot = parts_progress[index];
+	if (slot.attempt < 0)
+		return;
+	auto part = downloads[index];
+	auto &attempt = m_attempts[slot.attempt];
+	attempt.finished = QDateTime::currentMSecsSinceEpoch();
+	attempt.succeeded = success;
+	attempt.http_status = part->m_http_status;
+	// only trust the response time if it belongs to this attempt
+	if (part->m_response_time >= attempt.started)
+		attempt.first_byte = part->m_response_time;
+	// the part may have switched to another mirror, which is the one that counts
+	if (success)
+	{
+		attempt.url = part->m_url.toString();
+		// the host answered, whatever the breaker thought of it
+		if (attempt.first_byte >= 0)
+			HostCircuitBreaker::instance().reportSuccess(slot.host);
+	}
+	slot.attempt = -1;
+}
+
+void NetJob::endProbe(int index)
+{
+	auto &slot = parts_progress[index];
+	if (!slot.probe)
+		return;
+	// however it went, the host may be probed again
+	HostCircuitBreaker::instance().probeFinished(slot.host);
+	slot.probe = false;
+}
+
+void NetJob::jobFinished()
+{
+	// whoever listens gets the final numbers before the result
+	publishProgress();
+	// everything this job (and others before it) put in place goes to the disk now
+	FileSink::syncCommitted();
+
+	if (m_attempts.isEmpty())
+		return;
+	qint64 begin = m_attempts.first().queued, end = begin;
+	qint64 bytes = 0;
+	int not_modified = 0, failed_attempts = 0;
+	QMap<QString, QPair<qint64, int>> host_latency;
+	for (auto &attempt : m_attempts)
+	{
+		begin = std::min(begin, attempt.queued);
+		end = std::max(end, attempt.finished);
+		bytes += attempt.bytes;
+		if (attempt.http_status == 304)
+			not_modified++;
+		if (!attempt.succeeded)
+			failed_attempts++;
+		if (attempt.first_byte >= 0)
+		{
+			auto &latency = host_latency[hostOf(QUrl(attempt.url))];
+			latency.first += attempt.first_byte - attempt.started;
+			latency.second++;
+		}
+	}
+	QLOG_INFO() << m_job_name.toLocal8Bit() << "took" << end - begin << "ms:"
+				<< m_attempts.size() << "requests for" << downloads.size() << "parts,"
+				<< failed_attempts << "failed," << not_modified << "not modified," << bytes
+				<< "bytes";
+	for (auto iter = host_latency.begin(); iter != host_latency.end(); iter++)
+	{
+		QLOG_INFO() << m_job_name.toLocal8Bit() << "average time to first byte from"
+					<< iter.key() << ":" << iter.value().first / iter.value().second << "ms";
+	}
+
+	QString trace_dir = MMC->settings()->get("NetTraceDir").toString();
+	if (!trace_dir.isEmpty())
+	{
+		QString name = m_job_name;
+		name.replace(QRegExp("[^a-zA-Z0-9_.-]"), "_");
+		QString path = PathCombine(trace_dir, QString("%1-%2.json").arg(name).arg(begin));
+		if (ensureFilePathExists(path))
+			exportTrace(path);
+	}
+}
+
+QJsonObject NetJob::traceJson() const
+{
+	QJsonArray events;
+	// all parts of the job are threads of one 'process'
+	QJsonObject process_name;
+	process_name.insert("name", QString("process_name"));
+	process_name.insert("ph", QString("M"));
+	process_name.insert("pid", 1);
+	QJsonObject process_args;
+	process_args.insert("name", m_job_name);
+	process_name.insert("args", process_args);
+	events.append(process_name);
+
+	auto addEvent = [&](QString name, QString category, int part, qint64 from, qint64 to,
+						QJsonObject args)
+	{
+		if (from < 0 || to < from)
+			return;
+		QJsonObject event;
+		event.insert("name", name);
+		event.insert("cat", category);
+		event.insert("ph", QString("X"));
+		// microseconds
+		event.insert("ts", double(from) * 1000);
+		event.insert("dur", double(to - from) * 1000);
+		event.insert("pid", 1);
+		event.insert("tid", part);
+		event.insert("args", args);
+		events.append(event);
+	};
+
+	for (auto &attempt : m_attempts)
+	{
+		QJsonObject args;
+		args.insert("url", attempt.url);
+		args.insert("bytes", double(attempt.bytes));
+		args.insert("status", attempt.http_status);
+		args.insert("succeeded", attempt.succeeded);
+		args.insert("cache_hit", attempt.http_status == 304);
+		QString host = hostOf(QUrl(attempt.url));
+		addEvent("queued", "queue", attempt.part, attempt.queued, attempt.started, QJsonObject());
+		if (attempt.first_byte >= 0)
+		{
+			addEvent("waiting for " + host, "net", attempt.part, attempt.started,
+					 attempt.first_byte, args);
+			addEvent("receiving from " + host, "net", attempt.part, attempt.first_byte,
+					 attempt.finished, args);
+		}
+		else
+		{
+			addEvent(host.isEmpty() ? QString("request") : host, "net", attempt.part,
+					 attempt.started, attempt.finished, args);
+		}
+	}
+	QJsonObject root;
+	root.insert("traceEvents", events);
+	root.insert("displayTimeUnit", QString("ms"));
+	return root;
+}
+
+bool NetJob::exportTrace(QString path) const
+{
+	QFile file(path);
+	if (!file.open(QIODevice::WriteOnly))
+	{
+		QLOG_ERROR() << "Failed to write the network trace to" << path;
+		return false;
+	}
+	file.write(QJsonDocument(traceJson()).toJson(QJsonDocument::Compact));
+	file.close();
+	QLOG_INFO() << "Wrote the network trace of" << m_job_name << "to" << path;
+	return true;
+}
@@ -16,12 +16,14 @@
 #pragma once
 #include <QtNetwork>
 #include <QLabel>
+#include <QJsonObject>
 #include "NetAction.h"
 #include "ByteArrayDownload.h"
 #include "FileDownload.h"
 #include "CacheDownload.h"
 #include "HttpMetaCache.h"
 #include "ForgeXzDownload.h"
+#include "RetryPolicy.h"
 #include "logic/tasks/ProgressProvider.h"
 
 class NetJob;
@@ -31,7 +33,7 @@ class NetJob : public ProgressProvider
 {
 	Q_OBJECT
 public:
-	explicit NetJob(QString job_name) : ProgressProvider(), m_job_name(job_name) {};
+	explicit NetJob(QString job_name);
 
 	template <typename T> bool addNetAction(T action)
 	{
@@ -40,19 +42,42 @@ public:
 		downloads.append(action);
 		parts_progress.append(part_info());
 		total_progress++;
-		// if this is already running, the action needs to be started right away!
+		// if this is already running, the action needs to be scheduled right away!
 		if (isRunning())
 		{
-			emit progress(current_progress, total_progress);
-			connect(base.get(), SIGNAL(succeeded(int)), SLOT(partSucceeded(int)));
-			connect(base.get(), SIGNAL(failed(int)), SLOT(partFailed(int)));
-			connect(base.get(), SIGNAL(progress(int, qint64, qint64)),
-					SLOT(partProgress(int, qint64, qint64)));
-			base->start();
+			progressChanged();
+			connectPart(base.get());
+			enqueuePart(base->index_within_job);
+			startMoreParts();
 		}
 		return true;
 	}
 
+	/// maximum number of actions of this job that may be in flight at the same time
+	void setMaxInFlight(int max)
+	{
+		m_max_in_flight = max;
+	}
+	/// maximum number of actions of this job that may talk to the same host at the same time
+	void setMaxInFlightPerHost(int max)
+	{
+		m_max_in_flight_per_host = max;
+	}
+
+	/// cap the bandwidth of this job, in KiB/s. 0 means only the global caps apply
+	void setBandwidthLimit(int kib_per_second);
+	/// background jobs yield to everything else, and have their own cap
+	void setBackground(bool background)
+	{
+		m_background = background;
+	}
+
+	/// decides how failed parts are retried. the default backs off and retries 3 times
+	void setRetryPolicy(RetryPolicyPtr policy)
+	{
+		m_retry_policy = policy;
+	}
+
 	NetActionPtr operator[](int index)
 	{
 		return downloads[index];
@@ -85,9 +110,42 @@ public:
 	}
 	;
 	QStringList getFailedFiles();
+
+	/// smoothed transfer rate in bytes per second, -1 if unknown yet
+	qint64 bytesPerSecond() const
+	{
+		return m_rate < 0 ? -1 : qint64(m_rate);
+	}
+	/// estimated time left in msecs, -1 if unknown
+	qint64 eta() const;
+
+	/// one attempt at one part of the job. times are in msecs since the epoch, -1 if unknown
+	struct Attempt
+	{
+		int part;
+		QString url;
+		qint64 queued = -1;
+		qint64 started = -1;
+		qint64 first_byte = -1;
+		qint64 finished = -1;
+		qint64 bytes = 0;
+		int http_status = 0;
+		bool succeeded = false;
+	};
+	/// everything the job did, in the order it was started
+	QList<Attempt> attempts() const
+	{
+		return m_attempts;
+	}
+	/// the attempts as a Chrome trace (load it in chrome://tracing)
+	QJsonObject traceJson() const;
+	bool exportTrace(QString path) const;
+
 signals:
 	void started();
 	void progress(qint64 current, qint64 total);
+	/// published along with progress(). -1 means unknown
+	void transferRate(qint64 bytes_per_second, qint64 eta_msecs);
 	void filesProgress(int, int, int);
 	void succeeded();
 	void failed();
@@ -99,6 +157,29 @@ slots:
 	void partProgress(int index, qint64 bytesReceived, qint64 bytesTotal);
 	void partSucceeded(int index);
 	void partFailed(int index);
+	void publishProgress();
+	void retryTimerFired();
+
+private:
+	void connectPart(NetAction *part);
+	/// the host a request for 'url' really goes to, after the URL rewrites
+	static QString hostOf(const QUrl &url);
+	void enqueuePart(int index);
+	bool releasePart(int index);
+	void startMoreParts();
+	/// move parts off a host with an open breaker, if they can go elsewhere.
+	/// parts for hosts that are down go into 'dead'
+	void failOverFrom(QString host, QList<int> &dead);
+	/// the part failed for good. returns true if that finished the job
+	bool failPart(int index);
+	/// wake up when a delayed part or a blocked host can go again
+	void armRetryTimer();
+	void finishAttempt(int index, bool success);
+	/// if the part was probing its host, let the breaker know the probe is over
+	void endProbe(int index);
+	void jobFinished();
+	/// note that the progress changed. it gets published a little later, with other changes
+	void progressChanged();
 
 private:
 	struct part_info
@@ -106,6 +187,18 @@ private:
 		qint64 current_progress = 0;
 		qint64 total_progress = 1;
 		int failures = 0;
+		/// position in the ready queue, used to keep FIFO order within a priority
+		qint64 queue_order = 0;
+		/// host this part was scheduled against
+		QString host;
+		bool in_flight = false;
+		/// the current attempt is the probe of a host the breaker opened
+		bool probe = false;
+		/// hosts (mirrors) that failed this part already
+		QSet<QString> hosts_tried;
+		/// when it got in line, and its current attempt in m_attempts
+		qint64 queued_time = -1;
+		int attempt = -1;
 	};
 	QString m_job_name;
 	QList<NetActionPtr> downloads;
@@ -115,4 +208,33 @@ private:
 	int num_succeeded = 0;
 	int num_failed = 0;
 	bool m_running = false;
+
+	/// ready queues, one per host. each is ordered by priority, then FIFO.
+	QMap<QString, QList<int>> m_ready;
+	/// number of in-flight parts per host
+	QHash<QString, int> m_host_load;
+	int m_in_flight = 0;
+	qint64 m_queue_counter = 0;
+	bool m_scheduling = false;
+	/// limits, <= 0 means 'use the global setting'
+	int m_max_in_flight = 0;
+	int m_max_in_flight_per_host = 0;
+
+	QList<Attempt> m_attempts;
+
+	BandwidthLimiterPtr m_limiter;
+	bool m_background = false;
+
+	RetryPolicyPtr m_retry_policy = RetryPolicy::defaultPolicy();
+	/// parts waiting to be retried, by the time they may go again
+	QMultiMap<qint64, int> m_delayed;
+	QTimer m_retry_timer;
+
+	/// progress is published at a limited rate. parts only update the counters
+	QTimer m_progress_timer;
+	bool m_progress_dirty = false;
+	QElapsedTimer m_rate_clock;
+	qint64 m_rate_last_time = 0;
+	qint64 m_rate_last_progress = 0;
+	double m_rate = -1;
 };
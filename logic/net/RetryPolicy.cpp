@@ -0,0 +1,185 @@
+/* Copyright 2013 MultiMC Contributors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "RetryPolicy.h"
+#include "NetAction.h"
+
+#include <QDateTime>
+#include <algorithm>
+#include <cstdlib>
+#include "logger/QsLog.h"
+
+// retries of a part before it fails for good
+const int max_retries = 3;
+// backoff: 500ms, 1s, 2s... with jitter, never more than this
+const qint64 backoff_base = 500;
+const qint64 backoff_max = 30 * 1000;
+// a server asking us to wait longer than this is treated as down
+const qint64 retry_after_max = 60 * 1000;
+
+// failures in a row that open the breaker for a host
+const int breaker_threshold = 5;
+const qint64 breaker_cooldown_min = 5 * 1000;
+const qint64 breaker_cooldown_max = 2 * 60 * 1000;
+// times the breaker opens without a success in between before the host counts as down
+const int breaker_down_trips = 3;
+
+RetryPolicy::FailureKind RetryPolicy::classify(const NetAction &part) const
+{
+	int status = part.m_http_status;
+	if (status == 429 || status >= 500)
+		return Failure_Host;
+	// 408 is a timeout, 416 means our partial file was no good and got thrown away
+	if (status == 408 || status == 416)
+		return Failure_Transient;
+	if (status >= 400)
+		return Failure_Permanent;
+
+	switch (part.m_error)
+	{
+	case QNetworkReply::ConnectionRefusedError:
+	case QNetworkReply::RemoteHostClosedError:
+	case QNetworkReply::HostNotFoundError:
+	case QNetworkReply::TimeoutError:
+	case QNetworkReply::TemporaryNetworkFailureError:
+	case QNetworkReply::ProxyConnectionRefusedError:
+	case QNetworkReply::ProxyConnectionClosedError:
+	case QNetworkReply::ProxyNotFoundError:
+	case QNetworkReply::ProxyTimeoutError:
+	case QNetworkReply::UnknownNetworkError:
+		return Failure_Host;
+
+	case QNetworkReply::ContentAccessDenied:
+	case QNetworkReply::ContentOperationNotPermittedError:
+	case QNetworkReply::ContentNotFoundError:
+	case QNetworkReply::AuthenticationRequiredError:
+	case QNetworkReply::ProtocolUnknownError:
+	case QNetworkReply::ProtocolInvalidOperationError:
+		return Failure_Permanent;
+
+	default:
+		// bad data, disk trouble, our own timeouts...
+		return Failure_Transient;
+	}
+}
+
+qint64 RetryPolicy::retryDelay(const NetAction &part, FailureKind kind, int failures) const
+{
+	if (kind == Failure_Permanent || failures > max_retries)
+		return -1;
+
+	qint64 delay = backoff_base << std::min(failures - 1, 16);
+	delay = std::min(delay, backoff_max);
+	// anywhere between half and all of it, so parts that failed together don't come back
+	// together
+	delay = delay / 2 + qrand() % (delay / 2 + 1);
+
+	if (part.m_retry_after >= 0)
+	{
+		if (part.m_retry_after > retry_after_max)
+			return -1;
+		delay = std::max(delay, part.m_retry_after);
+	}
+	return delay;
+}
+
+RetryPolicyPtr RetryPolicy::defaultPolicy()
+{
+	static RetryPolicyPtr policy(new RetryPolicy());
+	return policy;
+}
+
+HostCircuitBreaker &HostCircuitBreaker::instance()
+{
+	static HostCircuitBreaker breaker;
+	return breaker;
+}
+
+bool HostCircuitBreaker::isOpen(QString host) const
+{
+	auto iter = m_hosts.find(host);
+	if (iter == m_hosts.end() || !(*iter).open_until)
+		return false;
+	// past the cooldown, one probe is allowed
+	if (QDateTime::currentMSecsSinceEpoch() < (*iter).open_until)
+		return true;
+	return (*iter).probing;
+}
+
+bool HostCircuitBreaker::isDown(QString host) const
+{
+	auto iter = m_hosts.find(host);
+	return iter != m_hosts.end() && (*iter).trips >= breaker_down_trips;
+}
+
+qint64 HostCircuitBreaker::retryTime(QString host) const
+{
+	auto iter = m_hosts.find(host);
+	if (iter == m_hosts.end() || !(*iter).open_until)
+		return 0;
+	if (QDateTime::currentMSecsSinceEpoch() < (*iter).open_until)
+		return (*iter).open_until;
+	return 0;
+}
+
+bool HostCircuitBreaker::requestStarted(QString host)
+{
+	auto iter = m_hosts.find(host);
+	if (iter == m_hosts.end() || !(*iter).open_until)
+		return false;
+	(*iter).probing = true;
+	return true;
+}
+
+void HostCircuitBreaker::probeFinished(QString host)
+{
+	auto iter = m_hosts.find(host);
+	if (iter != m_hosts.end())
+		(*iter).probing = false;
+}
+
+void HostCircuitBreaker::reportSuccess(QString host)
+{
+	auto iter = m_hosts.find(host);
+	if (iter == m_hosts.end())
+		return;
+	if ((*iter).open_until)
+		QLOG_INFO() << "Host" << host << "is back";
+	m_hosts.erase(iter);
+}
+
+void HostCircuitBreaker::reportFailure(QString host, bool probe)
+{
+	auto &state = m_hosts[host];
+	state.failures++;
+	if (state.open_until)
+	{
+		// requests sent before the breaker opened don't count, only the probe does
+		if (!probe)
+			return;
+		state.probing = false;
+	}
+	else if (state.failures < breaker_threshold)
+	{
+		return;
+	}
+	// tripped, or the probe failed
+	state.cooldown = state.cooldown ? std::min(state.cooldown * 2, breaker_cooldown_max)
+									: breaker_cooldown_min;
+	state.open_until = QDateTime::currentMSecsSinceEpoch() + state.cooldown;
+	state.trips++;
+	QLOG_WARN() << "Host" << host << "keeps failing, not using it for" << state.cooldown
+				<< "ms";
+}
@@ -0,0 +1,103 @@
+/* Copyright 2013 MultiMC Contributors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <QString>
+#include <QHash>
+#include <memory>
+
+class NetAction;
+
+typedef std::shared_ptr<class RetryPolicy> RetryPolicyPtr;
+
+/*
+ * Decides what NetJob does with a failed part: give up, or try again after a delay.
+ * Subclass it and give it to NetJob::setRetryPolicy() for jobs with special needs.
+ */
+class RetryPolicy
+{
+public:
+	virtual ~RetryPolicy()
+	{
+	}
+
+	enum FailureKind
+	{
+		/// trying again won't help (404 and friends)
+		Failure_Permanent,
+		/// might work next time (bad data, a dropped connection)
+		Failure_Transient,
+		/// the server is down or overloaded. counts against the host
+		Failure_Host
+	};
+
+	/// look at the last error of a failed part
+	virtual FailureKind classify(const NetAction &part) const;
+
+	/**
+	 * How long to wait before trying the part again, in msecs.
+	 * 'failures' is the number of failed attempts so far, including this one.
+	 * -1 means give up.
+	 */
+	virtual qint64 retryDelay(const NetAction &part, FailureKind kind, int failures) const;
+
+	/// exponential backoff with jitter, and Retry-After, with at most 3 retries
+	static RetryPolicyPtr defaultPolicy();
+};
+
+/*
+ * Keeps track of failing hosts, shared by all jobs.
+ *
+ * After a few failures in a row, a host is 'open': nothing is sent to it for a while.
+ * After that, one request gets through as a probe. If it works, the host is back to normal,
+ * if not, the wait gets longer. A host that keeps failing is considered down, and jobs
+ * fail the parts for it right away instead of waiting.
+ */
+class HostCircuitBreaker
+{
+public:
+	static HostCircuitBreaker &instance();
+
+	/// true if nothing should be sent to the host right now
+	bool isOpen(QString host) const;
+	/// true if the host failed so often that waiting for it isn't worth it
+	bool isDown(QString host) const;
+	/// msecs since the epoch when the host can be tried again, 0 if it can be tried now
+	qint64 retryTime(QString host) const;
+
+	/// a request to the host is going out. true if it is the probe
+	bool requestStarted(QString host);
+	/// the probe came back, whatever the outcome
+	void probeFinished(QString host);
+	void reportSuccess(QString host);
+	/// 'probe' is true if the failed request was the one requestStarted() allowed as probe
+	void reportFailure(QString host, bool probe);
+
+private:
+	struct HostState
+	{
+		/// failures in a row
+		int failures = 0;
+		/// when the host can be probed again. 0 if it isn't open
+		qint64 open_until = 0;
+		/// how long it was opened for the last time
+		qint64 cooldown = 0;
+		/// times it was opened without a success in between
+		int trips = 0;
+		bool probing = false;
+	};
+	QHash<QString, HostState> m_hosts;
+};
@@ -17,160 +17,386 @@
 #include "MultiMC.h"
 #include "logger/QsLog.h"
 #include <QUrlQuery>
-#include <qxmlstream.h>
-#include <QDomDocument>
+#include <QFile>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QJsonArray>
 
-inline QDomElement getDomElementByTagName(QDomElement parent, QString tagname)
-{
-	QDomNodeList elementList = parent.elementsByTagName(tagname);
-	if (elementList.count())
-		return elementList.at(0).toElement();
-	else
-		return QDomElement();
-}
+#define S3_SNAPSHOT_FORMAT_VERSION 1
 
-S3ListBucket::S3ListBucket(QUrl url) : NetAction()
+S3ListBucket::S3ListBucket(QUrl url, QString snapshot_path) : NetAction()
 {
 	m_url = url;
+	m_snapshot_path = snapshot_path;
 	m_status = Job_NotStarted;
 }
 
 void S3ListBucket::start()
+{
+	m_status = Job_InProgress;
+	objects.clear();
+	abortRequestsFrom(0);
+	m_next_page = 0;
+	bytesSoFar = 0;
+
+	if (loadSnapshot())
+	{
+		// we know the markers from last time. ask for all the pages at once, they will most
+		// likely be the same. advance() sorts it out if they aren't.
+		QString marker;
+		while (true)
+		{
+			auto iter = m_old_pages.find(marker);
+			if (iter == m_old_pages.end() || m_requests.size() > m_old_pages.size())
+				break;
+			requestPage(marker);
+			if (!(*iter).truncated || (*iter).objects.isEmpty())
+				break;
+			marker = (*iter).objects.last().Key;
+		}
+	}
+	if (m_requests.isEmpty())
+		requestPage(QString());
+}
+
+void S3ListBucket::requestPage(QString marker)
 {
 	QUrl finalUrl = m_url;
-	if (current_marker.size())
+	if (marker.size())
 	{
 		QUrlQuery query;
-		query.addQueryItem("marker", current_marker);
+		query.addQueryItem("marker", marker);
 		finalUrl.setQuery(query);
 	}
 	QNetworkRequest request(finalUrl);
-	request.setHeader(QNetworkRequest::UserAgentHeader, "MultiMC/5.0 (Uncached)");
+	request.setHeader(QNetworkRequest::UserAgentHeader, "MultiMC/5.0 (Cached)");
+	ContentDecoder::acceptCompressed(request);
+	auto old = m_old_pages.find(marker);
+	if (old != m_old_pages.end())
+	{
+		if (!(*old).etag.isEmpty())
+			request.setRawHeader("If-None-Match", (*old).etag.toLatin1());
+		if (!(*old).last_modified.isEmpty())
+			request.setRawHeader("If-Modified-Since", (*old).last_modified.toLatin1());
+	}
 	auto worker = MMC->qnam();
 	QNetworkReply *rep = worker->get(request);
 
-	m_reply = std::shared_ptr<QNetworkReply>(rep);
+	auto page_request = std::make_shared<PageRequest>();
+	page_request->page.marker = marker;
+	page_request->reply = std::shared_ptr<QNetworkReply>(rep);
+	m_requests.append(page_request);
+
 	connect(rep, SIGNAL(downloadProgress(qint64, qint64)),
 			SLOT(downloadProgress(qint64, qint64)));
 	connect(rep, SIGNAL(finished()), SLOT(downloadFinished()));
 	connect(rep, SIGNAL(error(QNetworkReply::NetworkError)),
 			SLOT(downloadError(QNetworkReply::NetworkError)));
 	connect(rep, SIGNAL(readyRead()), SLOT(downloadReadyRead()));
+	watchReply(rep);
+}
+
+S3ListBucket::PageRequestPtr S3ListBucket::requestFor(QObject *reply)
+{
+	for (int i = m_next_page; i < m_requests.size(); i++)
+	{
+		if (m_requests[i]->reply.get() == reply)
+			return m_requests[i];
+	}
+	return nullptr;
+}
+
+void S3ListBucket::abortRequestsFrom(int index)
+{
+	while (m_requests.size() > index)
+	{
+		auto request = m_requests.takeLast();
+		if (request->reply)
+		{
+			disconnect(request->reply.get(), 0, this, 0);
+			request->reply->abort();
+		}
+	}
 }
 
 void S3ListBucket::downloadProgress(qint64 bytesReceived, qint64 bytesTotal)
 {
-	emit progress(index_within_job, bytesSoFar + bytesReceived, bytesSoFar + bytesTotal);
+	auto request = requestFor(sender());
+	if (!request)
+		return;
+	request->received = bytesReceived;
+	request->total = bytesTotal;
+	qint64 received = bytesSoFar, total = bytesSoFar;
+	for (int i = m_next_page; i < m_requests.size(); i++)
+	{
+		received += m_requests[i]->received;
+		total += m_requests[i]->total;
+	}
+	emit progress(index_within_job, received, total);
 }
 
 void S3ListBucket::downloadError(QNetworkReply::NetworkError error)
 {
+	auto request = requestFor(sender());
+	if (!request)
+		return;
 	// error happened during download.
-	QLOG_ERROR() << "Error getting URL:" << m_url.toString().toLocal8Bit()
+	QLOG_ERROR() << "Error getting URL:" << request->reply->url().toString().toLocal8Bit()
 				 << "Network error: " << error;
-	m_status = Job_Failed;
+	request->failed = true;
 }
 
-void S3ListBucket::processValidReply()
+void S3ListBucket::downloadReadyRead()
 {
-	QLOG_TRACE() << "GOT: " << m_url.toString() << " marker:" << current_marker;
-	auto readContents = [&](QXmlStreamReader & xml)
+	auto request = requestFor(sender());
+	if (!request || request->failed)
+		return;
+	// an unchanged page has no body worth parsing
+	int status = request->reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+	if (status == 304)
+		return;
+	if (!takeData(request) || !parseMore(request))
 	{
-		QString Key, ETag, Size;
-		while (!(xml.tokenType() == QXmlStreamReader::EndElement && xml.name() == "Contents"))
-		{
-			if (xml.tokenType() == QXmlStreamReader::StartElement)
-			{
-				if (xml.name() == "Key")
-				{
-					Key = xml.readElementText();
-				}
-				if (xml.name() == "ETag")
-				{
-					ETag = xml.readElementText();
-				}
-				if (xml.name() == "Size")
-				{
-					Size = xml.readElementText();
-				}
-			}
-			xml.readNext();
-		}
-		if (xml.error() != QXmlStreamReader::NoError)
-			return;
-		objects.append({Key, ETag, Size.toLongLong()});
-	};
-
-	// nothing went wrong...
-	QString prefix("http://s3.amazonaws.com/Minecraft.Resources/");
-	QByteArray ba = m_reply->readAll();
+		QLOG_ERROR() << "Failed to process" << m_url.toString() << ". XML error:"
+					 << request->xml.errorString();
+		request->failed = true;
+		QMetaObject::invokeMethod(request->reply.get(), "abort", Qt::QueuedConnection);
+	}
+}
 
-	QString xmlErrorMsg;
+bool S3ListBucket::takeData(PageRequestPtr request)
+{
+	if (!request->decoder_ready)
+	{
+		if (!request->decoder.reset(request->reply->rawHeader("Content-Encoding")))
+			return false;
+		request->decoder_ready = true;
+	}
+	QByteArray data;
+	if (!request->decoder.decode(request->reply->readAll(), data))
+		return false;
+	request->xml.addData(data);
+	return true;
+}
 
-	bool is_truncated = false;
-	QXmlStreamReader xml(ba);
-	while (!xml.atEnd() && !xml.hasError())
+bool S3ListBucket::parseMore(PageRequestPtr request)
+{
+	auto &xml = request->xml;
+	while (!xml.atEnd())
 	{
-		/* Read next element.*/
 		QXmlStreamReader::TokenType token = xml.readNext();
-		/* If token is just StartDocument, we'll go to next.*/
-		if (token == QXmlStreamReader::StartDocument)
+		if (xml.hasError())
 		{
-			continue;
+			// out of data for now, the rest will come later
+			return xml.error() == QXmlStreamReader::PrematureEndOfDocumentError;
 		}
 		if (token == QXmlStreamReader::StartElement)
 		{
-			/* If it's named person, we'll dig the information from there.*/
 			if (xml.name() == "Contents")
 			{
-				readContents(xml);
+				request->in_contents = true;
+				request->current = S3Object();
+				request->current.size = 0;
+			}
+			request->text.clear();
+		}
+		else if (token == QXmlStreamReader::Characters)
+		{
+			request->text += xml.text();
+		}
+		else if (token == QXmlStreamReader::EndElement)
+		{
+			if (request->in_contents)
+			{
+				if (xml.name() == "Key")
+					request->current.Key = request->text;
+				else if (xml.name() == "ETag")
+					request->current.ETag = request->text;
+				else if (xml.name() == "Size")
+					request->current.size = request->text.toLongLong();
+				else if (xml.name() == "Contents")
+				{
+					request->page.objects.append(request->current);
+					request->in_contents = false;
+				}
 			}
 			else if (xml.name() == "IsTruncated")
 			{
-				is_truncated = (xml.readElementText() == "true");
+				request->page.truncated = (request->text == "true");
 			}
+			request->text.clear();
 		}
 	}
-	if (xml.hasError())
-	{
-		QLOG_ERROR() << "Failed to process s3.amazonaws.com/Minecraft.Resources. XML error:"
-					 << xml.errorString() << ba;
-		emit failed(index_within_job);
+	return true;
+}
+
+void S3ListBucket::downloadFinished()
+{
+	auto request = requestFor(sender());
+	if (!request)
 		return;
+	auto reply = request->reply;
+	request->done = true;
+
+	if (!request->failed)
+	{
+		int status = reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+		auto old = m_old_pages.find(request->page.marker);
+		if (status == 304 && old != m_old_pages.end())
+		{
+			QLOG_TRACE() << "UNCHANGED: " << m_url.toString() << " marker:"
+						 << request->page.marker;
+			request->page = *old;
+		}
+		else
+		{
+			QLOG_TRACE() << "GOT: " << m_url.toString() << " marker:" << request->page.marker;
+			// anything but a complete document is an error now
+			if (!takeData(request) || !request->decoder.isComplete() || !parseMore(request) ||
+				!request->xml.atEnd() || request->xml.hasError())
+			{
+				QLOG_ERROR() << "Failed to process" << m_url.toString() << ". XML error:"
+							 << request->xml.errorString();
+				request->failed = true;
+			}
+			request->page.etag = reply->rawHeader("ETag").constData();
+			request->page.last_modified = reply->rawHeader("Last-Modified").constData();
+		}
+		bytesSoFar += request->received;
+		request->received = request->total = 0;
 	}
-	if (is_truncated)
+	request->reply.reset();
+	advance();
+}
+
+void S3ListBucket::advance()
+{
+	while (m_next_page < m_requests.size() && m_requests[m_next_page]->done)
 	{
-		current_marker = objects.last().Key;
-		bytesSoFar += m_reply->size();
-		m_reply.reset();
-		start();
+		auto request = m_requests[m_next_page];
+		if (request->failed)
+		{
+			fail();
+			return;
+		}
+		m_next_page++;
+		auto &page = request->page;
+		if (!page.truncated || page.objects.isEmpty())
+		{
+			// that was the last page. anything after it is useless
+			abortRequestsFrom(m_next_page);
+			finish();
+			return;
+		}
+		// do we have the right request for the next page, if any?
+		QString next_marker = page.objects.last().Key;
+		if (m_next_page < m_requests.size() &&
+			m_requests[m_next_page]->page.marker == next_marker)
+			continue;
+		// the listing changed, or we didn't know it this far. continue one page at a time
+		abortRequestsFrom(m_next_page);
+		requestPage(next_marker);
 	}
-	else
+}
+
+void S3ListBucket::finish()
+{
+	for (auto request : m_requests)
 	{
-		m_status = Job_Finished;
-		m_reply.reset();
-		emit succeeded(index_within_job);
+		objects.append(request->page.objects);
 	}
-	return;
+	saveSnapshot();
+	m_requests.clear();
+	m_old_pages.clear();
+	m_status = Job_Finished;
+	emit succeeded(index_within_job);
 }
 
-void S3ListBucket::downloadFinished()
+void S3ListBucket::fail()
 {
-	// if the download succeeded
-	if (m_status != Job_Failed)
+	abortRequestsFrom(0);
+	m_old_pages.clear();
+	m_status = Job_Failed;
+	emit failed(index_within_job);
+}
+
+bool S3ListBucket::loadSnapshot()
+{
+	m_old_pages.clear();
+	if (m_snapshot_path.isEmpty())
+		return false;
+	QFile file(m_snapshot_path);
+	if (!file.open(QIODevice::ReadOnly))
+		return false;
+	QJsonParseError parseError;
+	QJsonDocument jsonDoc = QJsonDocument::fromJson(file.readAll(), &parseError);
+	file.close();
+	if (parseError.error != QJsonParseError::NoError || !jsonDoc.isObject())
 	{
-		processValidReply();
+		QLOG_WARN() << "Ignoring broken bucket listing snapshot" << m_snapshot_path;
+		return false;
 	}
-	// else the download failed
-	else
+	QJsonObject root = jsonDoc.object();
+	if (root.value("formatVersion").toVariant().toInt() != S3_SNAPSHOT_FORMAT_VERSION ||
+		root.value("url").toString() != m_url.toString())
+		return false;
+
+	for (auto pageVal : root.value("pages").toArray())
 	{
-		m_reply.reset();
-		emit failed(index_within_job);
-		return;
+		QJsonObject pageObj = pageVal.toObject();
+		Page page;
+		page.marker = pageObj.value("marker").toString();
+		page.etag = pageObj.value("etag").toString();
+		page.last_modified = pageObj.value("lastModified").toString();
+		page.truncated = pageObj.value("truncated").toBool();
+		for (auto objectVal : pageObj.value("objects").toArray())
+		{
+			// [key, etag, size]
+			QJsonArray objectArr = objectVal.toArray();
+			page.objects.append({objectArr.at(0).toString(), objectArr.at(1).toString(),
+								 (qlonglong)objectArr.at(2).toDouble()});
+		}
+		m_old_pages[page.marker] = page;
 	}
+	return !m_old_pages.isEmpty();
 }
 
-void S3ListBucket::downloadReadyRead()
+void S3ListBucket::saveSnapshot()
 {
-	// ~_~
+	if (m_snapshot_path.isEmpty())
+		return;
+	QJsonArray pages;
+	for (auto request : m_requests)
+	{
+		auto &page = request->page;
+		QJsonObject pageObj;
+		pageObj.insert("marker", page.marker);
+		pageObj.insert("etag", page.etag);
+		pageObj.insert("lastModified", page.last_modified);
+		pageObj.insert("truncated", page.truncated);
+		QJsonArray objectsArr;
+		for (auto &object : page.objects)
+		{
+			QJsonArray objectArr;
+			objectArr.append(object.Key);
+			objectArr.append(object.ETag);
+			objectArr.append((double)object.size);
+			objectsArr.append(objectArr);
+		}
+		pageObj.insert("objects", objectsArr);
+		pages.append(pageObj);
+	}
+	QJsonObject root;
+	root.insert("formatVersion", S3_SNAPSHOT_FORMAT_VERSION);
+	root.insert("url", m_url.toString());
+	root.insert("pages", pages);
+
+	QFile file(m_snapshot_path);
+	if (!file.open(QIODevice::WriteOnly))
+	{
+		QLOG_ERROR() << "Failed to write the bucket listing snapshot" << m_snapshot_path;
+		return;
+	}
+	file.write(QJsonDocument(root).toJson(QJsonDocument::Compact));
+	file.close();
 }
@@ -15,6 +15,9 @@
 
 #pragma once
 #include "NetAction.h"
+#include "ContentDecoder.h"
+#include <QXmlStreamReader>
+#include <QMap>
 
 struct S3Object
 {
@@ -28,10 +31,15 @@ class S3ListBucket : public NetAction
 {
 	Q_OBJECT
 public:
-	S3ListBucket(QUrl url);
-	static S3ListBucketPtr make(QUrl url)
+	/**
+	 * List the bucket at 'url'.
+	 * If 'snapshot_path' is set, the listing is kept there between runs and the pages
+	 * are only downloaded again when they changed.
+	 */
+	S3ListBucket(QUrl url, QString snapshot_path = QString());
+	static S3ListBucketPtr make(QUrl url, QString snapshot_path = QString())
 	{
-		return S3ListBucketPtr(new S3ListBucket(url));
+		return S3ListBucketPtr(new S3ListBucket(url, snapshot_path));
 	}
 
 public:
@@ -49,9 +57,52 @@ slots:
 	virtual void downloadReadyRead() override;
 
 private:
-	void processValidReply();
+	/// one page of the listing, starting after 'marker'
+	struct Page
+	{
+		QString marker;
+		QString etag;
+		QString last_modified;
+		bool truncated = false;
+		QList<S3Object> objects;
+	};
+	/// download and incremental parse of one page
+	struct PageRequest
+	{
+		Page page;
+		std::shared_ptr<QNetworkReply> reply;
+		QXmlStreamReader xml;
+		ContentDecoder decoder;
+		bool decoder_ready = false;
+		bool in_contents = false;
+		S3Object current;
+		QString text;
+		qint64 received = 0;
+		qint64 total = 0;
+		bool done = false;
+		bool failed = false;
+	};
+	typedef std::shared_ptr<PageRequest> PageRequestPtr;
+
+	void requestPage(QString marker);
+	PageRequestPtr requestFor(QObject *reply);
+	/// decode what the reply has for us and hand it to the XML reader
+	bool takeData(PageRequestPtr request);
+	bool parseMore(PageRequestPtr request);
+	void advance();
+	void finish();
+	void fail();
+	void abortRequestsFrom(int index);
+
+	bool loadSnapshot();
+	void saveSnapshot();
 
 private:
+	QString m_snapshot_path;
+	/// pages from the last run, by marker
+	QMap<QString, Page> m_old_pages;
+	/// page requests in listing order. the ones before m_next_page are done and verified
+	QList<PageRequestPtr> m_requests;
+	int m_next_page = 0;
 	qint64 bytesSoFar = 0;
-	QString current_marker;
 };
@@ -0,0 +1,34 @@
+/* Copyright 2013 MultiMC Contributors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <QString>
+
+/*
+ * The upstream endpoints we download from.
+ * Any of them can be pointed elsewhere (a LAN mirror, a local folder) by UrlResolver rules.
+ */
+namespace URLConstants
+{
+/// versions.json and the version folders with the jars and jsons
+const QString MOJANG_VERSIONS_BASE("http://s3.amazonaws.com/Minecraft.Download/versions/");
+/// the resources bucket, both the listing and the files
+const QString ASSETS_BASE("http://resources.download.minecraft.net/");
+/// forge version list
+const QString FORGE_JSON("http://files.minecraftforge.net/minecraftforge/json");
+/// forge library mirrors
+const QString FORGE_MIRROR_LIST("http://files.minecraftforge.net/mirror-brand.list");
+}
@@ -0,0 +1,84 @@
+/* Copyright 2013 MultiMC Contributors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "UrlResolver.h"
+
+#include <QFile>
+#include <QRegExp>
+#include <QNetworkRequest>
+#include <algorithm>
+#include "logger/QsLog.h"
+
+bool UrlResolver::load(QString path)
+{
+	QFile file(path);
+	if (!file.open(QIODevice::ReadOnly))
+		return false;
+	for (auto rawLine : file.readAll().split('\n'))
+	{
+		QString line = QString::fromUtf8(rawLine).trimmed();
+		if (line.isEmpty() || line.startsWith('#'))
+			continue;
+		QStringList parts = line.split(QRegExp("\\s+"));
+		if (parts.size() != 2)
+		{
+			QLOG_WARN() << "Ignoring bad URL rewrite rule:" << line;
+			continue;
+		}
+		addRule(parts[0], parts[1]);
+	}
+	return true;
+}
+
+void UrlResolver::addRule(QString prefix, QString replacement)
+{
+	QLOG_INFO() << "URL rewrite:" << prefix << "->" << replacement;
+	m_rules.append(qMakePair(prefix, replacement));
+	std::stable_sort(m_rules.begin(), m_rules.end(),
+					 [](const QPair<QString, QString> &a, const QPair<QString, QString> &b)
+	{ return a.first.size() > b.first.size(); });
+}
+
+QUrl UrlResolver::resolve(const QUrl &url) const
+{
+	if (m_rules.isEmpty())
+		return url;
+	QString str = url.toString();
+	for (auto &rule : m_rules)
+	{
+		if (str.startsWith(rule.first))
+			return QUrl(rule.second + str.mid(rule.first.size()));
+	}
+	return url;
+}
+
+ResolvingNetworkAccessManager::ResolvingNetworkAccessManager(UrlResolverPtr resolver,
+															 QObject *parent)
+	: QNetworkAccessManager(parent), m_resolver(resolver)
+{
+}
+
+QNetworkReply *ResolvingNetworkAccessManager::createRequest(Operation op,
+															const QNetworkRequest &request,
+															QIODevice *outgoingData)
+{
+	QUrl resolved = m_resolver->resolve(request.url());
+	if (resolved == request.url())
+		return QNetworkAccessManager::createRequest(op, request, outgoingData);
+
+	QNetworkRequest rewritten(request);
+	rewritten.setUrl(resolved);
+	return QNetworkAccessManager::createRequest(op, rewritten, outgoingData);
+}
@@ -0,0 +1,74 @@
+/* Copyright 2013 MultiMC Contributors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <QString>
+#include <QUrl>
+#include <QList>
+#include <QPair>
+#include <QNetworkAccessManager>
+#include <memory>
+
+/*
+ * Rewrites upstream URLs according to a list of prefix rules.
+ *
+ * The rules file has one rule per line: the URL prefix to replace and what to replace it
+ * with, separated by whitespace. Empty lines and lines starting with '#' are ignored.
+ * The longest matching prefix wins. For example:
+ *
+ *   http://s3.amazonaws.com/Minecraft.Download/ http://mirror.lan/minecraft/
+ *   http://resources.download.minecraft.net/ file:///srv/minecraft/resources/
+ */
+class UrlResolver
+{
+public:
+	/// load the rules from a file. a missing file means no rules
+	bool load(QString path);
+
+	void addRule(QString prefix, QString replacement);
+
+	/// where to really get 'url' from
+	QUrl resolve(const QUrl &url) const;
+
+	bool isEmpty() const
+	{
+		return m_rules.isEmpty();
+	}
+
+private:
+	/// sorted by prefix length, longest first
+	QList<QPair<QString, QString>> m_rules;
+};
+
+typedef std::shared_ptr<UrlResolver> UrlResolverPtr;
+
+/*
+ * Network access manager that sends every request through a UrlResolver.
+ * Everything that uses MMC->qnam() gets the rewrites without knowing about them.
+ */
+class ResolvingNetworkAccessManager : public QNetworkAccessManager
+{
+	Q_OBJECT
+public:
+	ResolvingNetworkAccessManager(UrlResolverPtr resolver, QObject *parent = 0);
+
+protected:
+	virtual QNetworkReply *createRequest(Operation op, const QNetworkRequest &request,
+										 QIODevice *outgoingData = 0) override;
+
+private:
+	UrlResolverPtr m_resolver;
+};